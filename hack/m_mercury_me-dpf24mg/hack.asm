@@ -39,6 +39,8 @@ CMD_BLON=COMMAND_BASE+1
 CMD_BLOFF=COMMAND_BASE+2
 CMD_LCDWAKE=COMMAND_BASE+3
 CMD_LCDSLEEP=COMMAND_BASE+4
+CMD_SETDIR=COMMAND_BASE+5 ; Set LCD entry mode I/D and AM bits from WBASE+0
+CMD_SETWINADDR=COMMAND_BASE+6 ; Set window, and start address at WBASE+6
 BYTECNT_BASE=$C0 ; $C0 to $FE transfers 1 to 63 bytes to the LCD controller
 
 ; *** Entry point ***
@@ -293,6 +295,15 @@ check4cmd cmp #(CMD_SETWIN-BYTECNT_BASE)&$FF
     beq lcdwake
     cmp #(CMD_LCDSLEEP-BYTECNT_BASE)&$FF
     beq lcdsleep
+; These are too far for a branch
+    cmp #(CMD_SETDIR-BYTECNT_BASE)&$FF
+    bne notsetdir
+    jmp setdir
+notsetdir=*
+    cmp #(CMD_SETWINADDR-BYTECNT_BASE)&$FF
+    bne notsetwinaddr
+    jmp setwinaddr
+notsetwinaddr=*
 
 ; Packet had no command, so simply ignore it.
     bra packetdone
@@ -335,14 +346,26 @@ lcddoseq=*
     jmp packetdone
 
 ; LCD window setting function
+; The start address is the window start, so copy it to where CMD_SETWINADDR
+; has it, and continue there.
 setaddr=*
+    lda WBASE+0
+    sta WBASE+6
+    lda WBASE+1
+    sta WBASE+7
+    lda WBASE+4
+    sta WBASE+8
+
+; LCD window and start address setting function
+; With other entry modes, writing starts from another corner of the window.
+setwinaddr=*
     ldx #0 ; X=0 for storing zeros without needing LDA
     stx $8000
     lda #$20 ; y1
     sta $8000
 
     stx $c000
-    lda WBASE+4
+    lda WBASE+8
     sta $c000
 
     stx $8000
@@ -365,9 +388,9 @@ setaddr=*
     lda #$21 ; x1
     sta $8000
 
-    lda WBASE+0
+    lda WBASE+6
     sta $c000
-    lda WBASE+1
+    lda WBASE+7
     sta $c000
 
     stx $8000
@@ -394,6 +417,23 @@ setaddr=*
 
     jmp packetdone
 
+; LCD entry mode setting function, for rotation
+; Sets R03 to ENTRY_MODE with the I/D1, I/D0 and AM bits from the packet.
+setdir=*
+    ldx #0
+    stx $8000
+    lda #$03 ; entry mode
+    sta $8000
+
+    lda #ENTRY_MODE>>8
+    sta $c000
+    lda WBASE+0
+    and #$38
+    ora #ENTRY_MODE&$FF
+    sta $c000
+
+    jmp packetdone
+
 ; *** LCD command sequences ***
 
 ; LCD sequences are stored starting at lcdtab. This
@@ -482,7 +522,8 @@ IF MEMHACK == 0
 
     db "H","4","C","K"
 ; Version of info block increased, because 2 bytes are needed for CONF_XRES.
-    db 2
+; Version 3 is the same, but says CMD_SETDIR and CMD_SETWINADDR are there.
+    db 3
     db CONF_XRES>>8
     db CONF_XRES&$FF
     db CONF_YRES
@@ -0,0 +1,153 @@
+/* gcc -Wall -O2 encbench.c -o encbench && ./encbench */
+
+/*
+ Measures how fast images are encoded into packets, without a device.
+ The old byte at a time encoder is kept here for comparison, and
+ its output is checked against the current one.
+ */
+
+#include "st2205.c"
+#include <time.h>
+
+#define RUNS 200
+
+static int old_adddata(char *buff, int p, char d)
+{
+    if ((p&63) == 0) {
+        p += 1;
+    }
+
+    buff[p] = d;
+
+    if ((p&63) == 63)
+        p = enddata(buff, p);
+    else
+        p++;
+
+    return p;
+}
+
+static unsigned int old_getpixel(st2205_handle *h, unsigned char *pix, unsigned int x, unsigned int y)
+{
+    unsigned int r, a;
+
+    if (x >= h->width || y >= h->height)
+        return 0;
+
+    a = (x+h->width*y)*3;
+    r = pix[a]+(pix[a+1]<<8)+(pix[a+2]<<16);
+
+    return r;
+}
+
+static int old_encode_rect(st2205_handle *h, char *buff, int p, unsigned char *pixinfo, int xs, int ys, int xe, int ye)
+{
+    int x, y, z;
+    unsigned int r, g, b, c;
+    long tr;
+
+    if (h->bpp == 12) {
+        xs-=(xs&1);
+        xe+=(xe-xs+1)&1;
+    }
+
+    p = pcf8833_setxy(h, h->proto, buff, p, xs, xe, ys, ye);
+    for (y=ys; y<=ye; y++) {
+        for (x=xs; x<=xe; x++) {
+            switch (h->bpp) {
+                case 24:
+                    c = old_getpixel(h, pixinfo, x, y);
+                    r = (c&0xff); g=(c>>8)&0xff; b=(c>>16)&0xff;
+                    p = old_adddata(buff, p, r);
+                    p = old_adddata(buff, p, g);
+                    p = old_adddata(buff, p, b);
+                break;
+                case 16:
+                    c = old_getpixel(h, pixinfo, x, y);
+                    r=(c&0xff); g=(c>>8)&0xff; b=(c>>16)&0xff;
+                    r>>=3; g>>=2; b>>=3;
+                    c=(r<<11)+(g<<5)+b;
+                    p = old_adddata(buff, p, (c>>8));
+                    p = old_adddata(buff, p, (c&255));
+                break;
+                case 12:
+                    tr=0;
+                    for (z=0; z<2; z++) {
+                        c = old_getpixel(h, pixinfo, x+z, y);
+                        r=(c&0xff); g=(c>>8)&0xff; b=(c>>16)&0xff;
+                        r>>=4;g>>=4;b>>=4;
+                        tr=(tr<<12)+(r<<8)+(g<<4)+(b);
+                    }
+                    p = old_adddata(buff, p, (tr>>16)&0xff);
+                    p = old_adddata(buff, p, (tr>>8)&0xff);
+                    p = old_adddata(buff, p, (tr)&0xff);
+                    x++;
+                break;
+            }
+        }
+    }
+
+    return enddata(buff, p);
+}
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ Encode a rect RUNS times with both encoders, printing megabytes of
+ r,g,b input per second.
+ */
+static void bench(st2205_handle *h, unsigned char *pix, char *ref, int xs, int ys, int xe, int ye)
+{
+    double t, told, tnew;
+    int i, pold = 0, pnew = 0;
+    double mb = (double)(xe - xs + 1) * (ye - ys + 1) * 3 * RUNS / 1e6;
+
+    t = now();
+    for (i=0; i<RUNS; i++)
+        pold = old_encode_rect(h, ref, 0, pix, xs, ys, xe, ye);
+    told = now() - t;
+
+    t = now();
+    for (i=0; i<RUNS; i++)
+        pnew = encode_rect(h, h->buff, 0, pix, xs, ys, xe, ye);
+    tnew = now() - t;
+
+    printf("%2i bpp %3ix%-3i: old %7.1f MB/s, new %7.1f MB/s %s\n",
+           h->bpp, xe - xs + 1, ye - ys + 1, mb / told, mb / tnew,
+           (pold == pnew && !memcmp(ref, h->buff, pnew)) ? "" : "OUTPUT DIFFERS");
+}
+
+int main(void)
+{
+    st2205_handle h;
+    static unsigned char pix[320*240*3];
+    static char buff[BUFF_SIZE], ref[BUFF_SIZE];
+    int i;
+
+    select_kernels();
+
+    for (i=0; i<(int)sizeof(pix); i++)
+        pix[i] = rand();
+
+    memset(&h, 0, sizeof(h));
+    h.width = 320;
+    h.height = 240;
+    h.proto = PROTO_MERCURY;
+    h.buff = buff;
+
+    for (h.bpp=24; h.bpp>=12; h.bpp-=4) {
+        if (h.bpp == 20)
+            continue;
+        bind_encoder(&h);
+        bench(&h, pix, ref, 0, 0, 319, 239);
+        bench(&h, pix, ref, 11, 20, 130, 99);
+    }
+
+    return 0;
+}
@@ -1,4 +1,3 @@
-#define NO_PARM_BLOCK
 /*
     ST2205U image library
     Copyright (C) 2008 Jeroen Domburg <jeroen@spritesmods.com>
@@ -28,13 +27,32 @@
 #include <sys/types.h>
 #ifndef _WIN32
 #include <sys/mman.h>
+#include <signal.h>
 #endif
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <ctype.h>
+#include <time.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <scsi/sg.h>
+#include <limits.h>
+#endif
 #include "st2205.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #define BUFF_SIZE 320*240*3*2 //0x10000
 
 #define DPRINT(...) fprintf(stderr, __VA_ARGS__)
@@ -49,6 +67,8 @@
 #define CMD_BLOFF (COMMAND_BASE+2) /* Backlight off */
 #define CMD_LCDWAKE (COMMAND_BASE+3) /* Wake LCD from deep sleep */
 #define CMD_LCDSLEEP (COMMAND_BASE+4) /* LCD deep sleep, forgetting image data */
+#define CMD_SETDIR (COMMAND_BASE+5) /* Set LCD entry mode, since version 3 */
+#define CMD_SETWINADDR (COMMAND_BASE+6) /* Set window and start address, since version 3 */
 
 /*
  Two routines to allocate/deallocate page-aligned memory, for use with the
@@ -107,34 +127,69 @@ typedef struct {
     char offy;
 } fw_descriptor;
 
+#ifdef __linux__
 /*
- Checks if the device is a photo frame by reading the first 512 bytes and
- comparing against the known string that's there
-*/
-static int is_photoframe(int f)
+ Reads the first line of the file name in dir, without the newline.
+ */
+static int read_line(const char *dir, const char *name, char *buf, int size)
 {
-    int res;
-    char id[] = "SITRONIX CORP.";
-    char *buff;
+    char path[PATH_MAX];
+    FILE *f;
+    int n;
 
-    buff = malloc_aligned(0x200);
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    if (fgets(buf, size, f) == NULL)
+        buf[0] = 0;
+    fclose(f);
+    n = strlen(buf);
+    if (n > 0 && buf[n - 1] == '\n')
+        buf[--n] = 0;
+    return n;
+}
 
-    if (buff == NULL) {
-        fprintf(stderr, "aligned_malloc failed :(\n");
-        return 0;
-    }
+/*
+ Finds the sysfs directory of the USB device the block or sg device st is on.
+ */
+static int usb_device_dir(const struct stat *st, char *dir)
+{
+    char path[64], line[16], *p;
 
-    if (lseek(f, 0x0, SEEK_SET) < 0 || read(f, buff, 0x200) < 0) {
-        perror(NULL);
-        return 0;
+    snprintf(path, sizeof(path), "/sys/dev/%s/%u:%u", S_ISBLK(st->st_mode) ? "block" : "char",
+             major(st->st_rdev), minor(st->st_rdev));
+    if (realpath(path, dir) == NULL)
+        return -1;
+    while (read_line(dir, "busnum", line, sizeof(line)) <= 0) {
+        p = strrchr(dir, '/');
+        if (p == NULL || p == dir)
+            return -1;
+        *p = 0;
     }
+    return 0;
+}
 
-    res = strncmp(buff, id, 15);
-
-    free_aligned(buff, 0x200);
+/*
+ Gets the serial number of the display, or for an image file used for
+ testing, where it is.
+ */
+static int device_serial(int fd, char *serial, int size)
+{
+    char dir[PATH_MAX];
+    struct stat st;
 
-    return !res;
+    if (fstat(fd, &st) < 0)
+        return -1;
+    if (!S_ISBLK(st.st_mode) && !S_ISCHR(st.st_mode)) {
+        snprintf(serial, size, "file-%lu-%lu", (unsigned long)st.st_dev, (unsigned long)st.st_ino);
+        return 0;
+    }
+    if (usb_device_dir(&st, dir) < 0 || read_line(dir, "serial", serial, size) <= 0)
+        return -1;
+    return 0;
 }
+#endif /* __linux__ */
 
 /*
  The interface works by writing bytes to the raw 'disk' at certain positions.
@@ -147,18 +202,138 @@ static int is_photoframe(int f)
 #define POS_WDAT 0x6600
 #define POS_RDAT 0xb000
 
-#ifndef NO_PARM_BLOCK
-static int sendcmd(int fd, int cmd, unsigned int arg1, unsigned int arg2, unsigned char arg3)
+/*
+ Those positions can also be reached with SCSI READ(10) and WRITE(10)
+ commands sent through SG_IO, at LBA position/512. That bypasses the block
+ layer, which splits transfers and puts them through the I/O scheduler.
+ It is the only way with /dev/sgN. sgmax is the most bytes sent in one
+ command, or 0 for reads and writes on the block device.
+ */
+#ifdef __linux__
+#define SG_TIMEOUT 10000 /* ms */
+#define SG_DEFAULT_MAX 0x10000
+
+static int sg_rw(int fd, int sgmax, int wr, unsigned int pos, char *buff, int len)
 {
-    unsigned char *buff;
+    unsigned char cdb[10], sense[32];
+    sg_io_hdr_t io;
+    unsigned int lba;
+    int done, n;
 
-    buff = malloc_aligned(0x200);
+    for (done = 0; done < len; done += n) {
+        n = len - done < sgmax ? len - done : sgmax;
+        lba = pos / 512 + done / 512;
 
-    if (buff == NULL) {
-        fprintf(stderr, "malloc_aligned failed :(\n");
+        memset(cdb, 0, sizeof(cdb));
+        cdb[0] = wr ? 0x2a : 0x28; /* WRITE(10) or READ(10) */
+        cdb[2] = lba >> 24;
+        cdb[3] = lba >> 16;
+        cdb[4] = lba >> 8;
+        cdb[5] = lba;
+        cdb[7] = (n / 512) >> 8;
+        cdb[8] = n / 512;
+
+        memset(&io, 0, sizeof(io));
+        io.interface_id = 'S';
+        io.dxfer_direction = wr ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV;
+        io.cmd_len = sizeof(cdb);
+        io.cmdp = cdb;
+        io.mx_sb_len = sizeof(sense);
+        io.sbp = sense;
+        io.dxfer_len = n;
+        io.dxferp = buff + done;
+        io.timeout = SG_TIMEOUT;
+
+        if (ioctl(fd, SG_IO, &io) < 0)
+            return done ? done : -1;
+        if ((io.info & SG_INFO_OK_MASK) != SG_INFO_OK)
+            return done ? done : -1;
+
+        /* Short, like write() and read() can be */
+        if (io.resid > 0)
+            return done + n - io.resid;
+    }
+
+    return len;
+}
+
+/*
+ The largest transfer the device takes, in whole sectors. The sg driver
+ gives it in bytes, block devices in sectors.
+ */
+static int sg_max(int fd)
+{
+    struct stat st;
+    unsigned short sectors = 0;
+    int bytes = 0;
+
+    if (fstat(fd, &st) < 0)
+        return SG_DEFAULT_MAX;
+    if (S_ISCHR(st.st_mode)) {
+        if (ioctl(fd, BLKSECTGET, &bytes) < 0 || bytes < 512)
+            return SG_DEFAULT_MAX;
+    } else {
+        if (ioctl(fd, BLKSECTGET, &sectors) < 0 || sectors == 0)
+            return SG_DEFAULT_MAX;
+        bytes = sectors * 512;
+    }
+    /* WRITE(10) has 16 bits for the number of sectors */
+    if (bytes > 0xffff * 512)
+        bytes = 0xffff * 512;
+    return bytes & ~511;
+}
+#endif /* __linux__ */
+
+static int dev_write(int fd, int sgmax, unsigned int pos, char *buff, int len)
+{
+#ifdef __linux__
+    if (sgmax > 0)
+        return sg_rw(fd, sgmax, 1, pos, buff, len);
+#endif
+    if (lseek(fd, pos, SEEK_SET) < 0)
+        return -1;
+    return write(fd, buff, len);
+}
+
+static int dev_read(int fd, int sgmax, unsigned int pos, char *buff, int len)
+{
+#ifdef __linux__
+    if (sgmax > 0)
+        return sg_rw(fd, sgmax, 0, pos, buff, len);
+#endif
+    if (lseek(fd, pos, SEEK_SET) < 0)
         return -1;
+    return read(fd, buff, len);
+}
+
+/*
+ Checks if the device is a photo frame by reading the first 512 bytes into
+ buff, which is aligned, and comparing against the known string that's there
+*/
+static int is_photoframe(int f, int sgmax, char *buff)
+{
+    char id[] = "SITRONIX CORP.";
+
+    if (dev_read(f, sgmax, 0x0, buff, 0x200) < 0) {
+        perror(NULL);
+        return 0;
     }
 
+    return !strncmp(buff, id, 15);
+}
+
+
+#ifndef NO_PARM_BLOCK
+/* Commands of the original firmware */
+#define CMD_FLASH_CHECKSUM 2
+#define CMD_FLASH_READ 4
+
+/*
+ Sends a command, using the first 512 bytes of the aligned buffer buff.
+ */
+static int sendcmd(int fd, int sgmax, char *buff, int cmd, unsigned int arg1, unsigned int arg2, unsigned char arg3)
+{
+    memset(buff, 0, 0x200);
     buff[0] = cmd;
     buff[1] = (arg1>>0x18)&0xff;
     buff[2] = (arg1>>0x10)&0xff;
@@ -170,27 +345,15 @@ static int sendcmd(int fd, int cmd, unsigned int arg1, unsigned int arg2, unsign
     buff[8] = (arg2>>0x00)&0xff;
     buff[9] = (arg3);
 
-    if (lseek(fd, POS_CMD, SEEK_SET) < 0) {
-        return -1;
-    }
-
-    return write(fd, buff, 0x200);
-}
-
-static int read_data(int fd, char* buff, int len)
-{
-    if (lseek(fd, POS_RDAT, SEEK_SET) < 0)
-        return -1;
-    return read(fd, buff, len);
+    return dev_write(fd, sgmax, POS_CMD, buff, 0x200);
 }
 
-static int write_data(int fd, char* buff, int len)
+static int read_data(int fd, int sgmax, char* buff, int len)
 {
-    if (lseek(fd, POS_WDAT, SEEK_SET) < 0)
-        return -1;
-    return write(fd, buff, len);
+    return dev_read(fd, sgmax, POS_RDAT, buff, len);
 }
 
+#ifdef DEBUG
 /*
 Debugging routine to dump a buffer in a hexdump-like fashion.
 */
@@ -225,351 +388,4960 @@ static void dumpmem(unsigned char* mem, int len)
         printf("\n");
     }
 }
+#endif
+
+/*
+ What the descriptor in the hacked firmware says. Version 1 of the
+ descriptor is fw_descriptor. Version 2 has the same fields, but with the
+ width in 2 bytes, high byte first. Version 3 is the same as version 2, and
+ says the firmware has CMD_SETDIR and CMD_SETWINADDR.
+ */
+typedef struct {
+    int width;
+    int height;
+    int bpp;
+    int proto;
+    int offx;
+    int offy;
+    int version;
+} parm_block;
 
 #define FW_PAGE_OFFSET 0xFE //((2048-64)/32)
-static fw_descriptor *get_parm_block(int fd, char* buff)
+static int get_parm_block(int fd, int sgmax, char* buff, parm_block *pb)
 {
     int a, p;
     char lookfor[] = "H4CK\000";
+    fw_descriptor *b;
+    unsigned char *d;
 
     /*
-     Read 64K of firmware into buff
+     Read 64K of firmware into buff, with commands written from just after
      */
-    sendcmd(fd, 4, FW_PAGE_OFFSET, 0x8000, 0);
-    read_data(fd, buff, 0x8000);
-    sendcmd(fd, 4, FW_PAGE_OFFSET+1, 0x8000, 0);
-    read_data(fd, buff+0x8000, 0x8000);
+    sendcmd(fd, sgmax, buff + 0x10000, CMD_FLASH_READ, FW_PAGE_OFFSET, 0x8000, 0);
+    read_data(fd, sgmax, buff, 0x8000);
+    sendcmd(fd, sgmax, buff + 0x10000, CMD_FLASH_READ, FW_PAGE_OFFSET+1, 0x8000, 0);
+    read_data(fd, sgmax, buff+0x8000, 0x8000);
 
     /*
      Look for 'H4CK' string
      */
-    for (a=0; a<0x10000-8; a++) {
+    for (a=0; a<0x10000-9; a++) {
         p = 0;
         while (lookfor[p] != 0 && buff[a+p] == lookfor[p])
             p++;
-        if (lookfor[p] == 0) {
-            return (fw_descriptor*)(buff+a);
-        }
+        if (lookfor[p] == 0)
+            break;
     }
+    if (a >= 0x10000-9)
+        return -1;
 
-    return NULL;
+    b = (fw_descriptor*)(buff+a);
+    d = (unsigned char *)buff + a;
+    if (b->version == 1) {
+        pb->width  = b->width;
+        pb->height = b->height;
+        pb->bpp    = b->bpp;
+        pb->proto  = b->proto;
+        pb->offx   = b->offx;
+        pb->offy   = b->offy;
+    } else if (b->version == 2 || b->version == 3) {
+        pb->width  = (d[5] << 8) | d[6];
+        pb->height = d[7];
+        pb->bpp    = (signed char)d[8];
+        pb->proto  = (signed char)d[9];
+        pb->offx   = (signed char)d[10];
+        pb->offy   = (signed char)d[11];
+    } else {
+        fprintf(stderr, "Unknown version %hhi\n", b->version);
+        return -1;
+    }
+    pb->version = b->version;
+
+    return 0;
 }
-#endif /* #ifndef NO_PARM_BLOCK */
 
-static int enddata(char *buff, int p)
+#ifdef __linux__
+/*
+ Reading the descriptor takes reading 64K of flash, so it is kept in
+ $XDG_CACHE_HOME/libst2205 or ~/.cache/libst2205. The file name is made
+ from the serial number and the checksums of the two firmware pages, which
+ is only 1K to read.
+ */
+static int fw_checksum(int fd, int sgmax, char *buff, int page, unsigned int *c)
 {
-    int pageaddr, offset;
-
-    offset = p & 63;
-    pageaddr = p-offset;
-
-    if (offset == 0)
-        return p;
-
-    //buff[pageaddr + 1] = offset - 1;
-    buff[pageaddr] = 0xC0 + offset - 1;
-    //fprintf(stderr, "(%i)", buff[pageaddr]);
-    p = pageaddr + 64;
+    unsigned char *d = (unsigned char *)buff;
 
-    return p;
+    /* Firmware subtracts two from the whole 16 bit value */
+    if (sendcmd(fd, sgmax, buff, CMD_FLASH_CHECKSUM, (page-2)&0xFFFF, 0, 0) != 0x200 ||
+        read_data(fd, sgmax, buff, 0x200) != 0x200)
+        return -1;
+    *c = (d[0]<<24) | (d[1]<<16) | (d[2]<<8) | d[3];
+    return 0;
 }
 
-static int pcf8833_setxy(st2205_handle *h, char *buff, int p, int xs, int xe, int ys, int ye)
+static int parm_cache_path(int fd, int sgmax, char *buff, char *path, int size)
 {
-    int xsoff = xs + h->offx;
-    int xeoff = xe + h->offx;
-
-    p = enddata(buff, p);
+    char dir[PATH_MAX], serial[128];
+    const char *base;
+    unsigned int c0, c1;
+    int i;
 
-    switch (h->proto) {
-    case PROTO_PCF8833:
-        buff[p] = 1;
-        buff[p+1] = xsoff;
-        buff[p+2] = xeoff;
-        buff[p+3] = ys + h->offy;
-        buff[p+4] = ye + h->offy;
-        break;
+    if (device_serial(fd, serial, sizeof(serial)) < 0 ||
+        fw_checksum(fd, sgmax, buff, 0, &c0) < 0 || fw_checksum(fd, sgmax, buff, 1, &c1) < 0)
+        return -1;
+    for (i = 0; serial[i] != 0; i++)
+        if (!isalnum((unsigned char)serial[i]))
+            serial[i] = '_';
 
-    case PROTO_MERCURY:
-        buff[p] = CMD_SETWIN;
-        buff[p+1] = (xsoff & 0xff00) >> 8;
-        buff[p+2] = (xsoff & 0xff);
-        buff[p+3] = (xeoff & 0xff00) >> 8;
-        buff[p+4] = (xeoff & 0xff);
-        buff[p+5] = ys + h->offy;
-        buff[p+6] = ye + h->offy;
-        break;
-    default:
-        fprintf(stderr, "libst2205: Unrecognized protocol: 0x%x!\n", h->proto);
-        //TODO: do not exit here, library should just send error to app
-        exit(1);
+    base = getenv("XDG_CACHE_HOME");
+    if (base != NULL && base[0] == '/') {
+        snprintf(dir, sizeof(dir), "%s", base);
+    } else {
+        base = getenv("HOME");
+        if (base == NULL)
+            return -1;
+        snprintf(dir, sizeof(dir), "%s/.cache", base);
+        mkdir(dir, 0700);
     }
+    i = strlen(dir);
+    snprintf(dir + i, sizeof(dir) - i, "/libst2205");
+    mkdir(dir, 0700);
 
-    p += 64;
-    return p;
+    snprintf(path, size, "%s/%s-%08x-%08x", dir, serial, c0, c1);
+    return 0;
 }
 
-static int adddata(char *buff, int p, char d)
+static int get_parms(int fd, int sgmax, char *buff, parm_block *pb)
 {
-    if ((p&63) == 0) {
-//        buff[p] = 0;
-//        p += 2;
-        p += 1;
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    FILE *f;
+    int n, cache;
+
+    cache = parm_cache_path(fd, sgmax, buff, path, sizeof(path)) == 0;
+    if (cache) {
+        f = fopen(path, "r");
+        if (f != NULL) {
+            n = fscanf(f, "%d %d %d %d %d %d %d", &pb->width, &pb->height, &pb->bpp,
+                       &pb->proto, &pb->offx, &pb->offy, &pb->version);
+            fclose(f);
+            if (n == 7 && pb->width > 0 && pb->height > 0)
+                return 0;
+        }
     }
 
-    buff[p] = d;
+    if (get_parm_block(fd, sgmax, buff, pb) < 0)
+        return -1;
 
-    if ((p&63) == 63)
-        p = enddata(buff, p);
-    else
-        p++;
+    if (cache) {
+        /* Written whole or not at all, for any other process opening it */
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+        f = fopen(tmp, "w");
+        if (f != NULL) {
+            fprintf(f, "%d %d %d %d %d %d %d\n", pb->width, pb->height, pb->bpp,
+                    pb->proto, pb->offx, pb->offy, pb->version);
+            if (fclose(f) == 0)
+                rename(tmp, path);
+            else
+                unlink(tmp);
+        }
+    }
 
-    return p;
+    return 0;
+}
+#else /* !__linux__ */
+static int get_parms(int fd, int sgmax, char *buff, parm_block *pb)
+{
+    return get_parm_block(fd, sgmax, buff, pb);
 }
+#endif /* !__linux__ */
+#endif /* #ifndef NO_PARM_BLOCK */
 
-static unsigned int getpixel(st2205_handle *h, unsigned char *pix, unsigned int x, unsigned int y)
+/*
+ Compare len bytes at a and b. Returns the offset of the first difference,
+ and stores the offset of the last difference in *end, or returns -1 and
+ stores -1 if there is no difference. One of these gets picked by
+ select_kernels().
+ */
+static int diff_span_scalar(const unsigned char *a, const unsigned char *b, int len, int *end)
 {
-    unsigned int r, a;
+    int s, e;
 
-    if (x >= h->width || y >= h->height)
-        return 0;
+    for (s=0; s<len && a[s] == b[s]; s++);
 
-    a = (x+h->width*y)*3;
-    r = pix[a]+(pix[a+1]<<8)+(pix[a+2]<<16);
+    if (s == len) {
+        *end = -1;
+        return -1;
+    }
 
-    return r;
+    for (e=len-1; a[e] == b[e]; e--);
+
+    *end = e;
+    return s;
 }
 
-static int write_stream(st2205_handle *h, char *buff, int len)
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static int diff_span_sse2(const unsigned char *a, const unsigned char *b, int len, int *end)
 {
-    /*
-     Pad to 512-byte boundary, with 0xff
-     */
-    for(; len%512; len++) {
-        buff[len] = 0;
+    int s, e;
+    unsigned int m;
+
+    for (s=0; s+16<=len; s+=16) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a+s)),
+                                             _mm_loadu_si128((const __m128i *)(b+s))));
+        if (m != 0xffff) {
+            s += __builtin_ctz(~m);
+            goto found;
+        }
     }
 
-    //DPRINT("Writing 0x%x bytes.\n",len);
+    for (; s<len && a[s] == b[s]; s++);
 
-    if (lseek(h->fd, POS_WDAT, SEEK_SET) < 0)
+    if (s == len) {
+        *end = -1;
         return -1;
+    }
+
+found:
+    /* A difference exists, so these loops stop at s or before */
+    for (e=len-16; e>=0; e-=16) {
+        m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a+e)),
+                                              _mm_loadu_si128((const __m128i *)(b+e)))) & 0xffff;
+        if (m != 0) {
+            *end = e + 31 - __builtin_clz(m);
+            return s;
+        }
+    }
+
+    for (e+=15; a[e] == b[e]; e--);
 
-    return write(h->fd, buff, len);
+    *end = e;
+    return s;
 }
 
-/*
- Sends image (xs,ys)-(xe,ye), inclusive.
- */
-void st2205_send_partial(st2205_handle *h, unsigned char *pixinfo, int xs, int ys, int xe, int ye)
+__attribute__((target("avx2")))
+static int diff_span_avx2(const unsigned char *a, const unsigned char *b, int len, int *end)
 {
-    int p, x, y, z;
-    unsigned int r, g, b, c;
-    long tr;
+    int s, e;
+    unsigned int m;
 
-    /*
-     bpp=12, make width and xstart even
-     */
-    if (h->bpp == 12) {
-        xs-=(xs&1);
-        xe+=(xe-xs+1)&1;
+    for (s=0; s+32<=len; s+=32) {
+        m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a+s)),
+                                                   _mm256_loadu_si256((const __m256i *)(b+s))));
+        if (m != 0xffffffff) {
+            s += __builtin_ctz(~m);
+            goto found;
+        }
     }
 
-    p = 0;
-    p = pcf8833_setxy(h, h->buff, 0, xs, xe, ys, ye);
-    for (y=ys; y<=ye; y++) {
-        for (x=xs; x<=xe; x++) {
-            //fprintf(stderr, "(%i,%i)",x,y);
-            switch (h->bpp) {
-                case 24:
-                    c = getpixel(h, pixinfo, x, y);
-                    r = (c&0xff); g=(c>>8)&0xff; b=(c>>16)&0xff;
-                    p = adddata(h->buff, p, r);
-                    p = adddata(h->buff, p, g);
-                    p = adddata(h->buff, p, b);
-                break;
-                case 16:
-                    c = getpixel(h, pixinfo, x, y);
-                    r=(c&0xff); g=(c>>8)&0xff; b=(c>>16)&0xff;
-                    r>>=3; g>>=2; b>>=3;
-                    c=(r<<11)+(g<<5)+b;
-                    p = adddata(h->buff, p, (c>>8));
-                    p = adddata(h->buff, p, (c&255));
-                break;
-                case 12:
-                    tr=0;
-                    for (z=0; z<2; z++) {
-                        c = getpixel(h, pixinfo, x+z, y);
-                        r=(c&0xff); g=(c>>8)&0xff; b=(c>>16)&0xff;
-                        r>>=4;g>>=4;b>>=4;
-                        tr=(tr<<12)+(r<<8)+(g<<4)+(b);
-                    }
-                //        p=adddata(h->buff,p,0xff);
-                //        p=adddata(h->buff,p,0xff);
-                //        p=adddata(h->buff,p,0xff);
-
-                    p = adddata(h->buff, p, (tr>>16)&0xff);
-                    p = adddata(h->buff, p, (tr>>8)&0xff);
-                    p = adddata(h->buff, p, (tr)&0xff);
-                    x++; //because we handle 2 pixels at a time
-                break;
-                default:
-                    fprintf(stderr, "libst2205: Unknown bpp for this display: %i\n", h->bpp);
-                    //TODO: do not exit here, library should just send error to app
-                    exit(1);
-                break;
-            }
+    for (; s<len && a[s] == b[s]; s++);
+
+    if (s == len) {
+        *end = -1;
+        return -1;
+    }
+
+found:
+    for (e=len-32; e>=0; e-=32) {
+        m = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a+e)),
+                                                    _mm256_loadu_si256((const __m256i *)(b+e))));
+        if (m != 0) {
+            *end = e + 31 - __builtin_clz(m);
+            return s;
         }
     }
 
-    p = enddata(h->buff, p);
-    write_stream(h, h->buff, p);
+    for (e+=31; a[e] == b[e]; e--);
+
+    *end = e;
+    return s;
 }
+#endif /* HAVE_X86_SIMD */
 
 /*
- Pixinfo is a char array containing r,g,b triplets.
+ Like diff_span(), but only bytes which differ by more than t count.
  */
-void st2205_send_data(st2205_handle *h, unsigned char *pixinfo)
+static int near_span_scalar(const unsigned char *a, const unsigned char *b, int len, int t, int *end)
 {
-    unsigned int x,y,xs,xe,ys,ye,c1,c2;
-
-
-    /*
-     PCF8833 has the possibility to do partial transfers into a certain bounding
-     box. Optimize for that by looking for the smallest bounding box containing
-     all changes.
-     */
-        xe = 0; ye = 0; xs = h->width; ys = h->height;
-    if (h->proto == PROTO_PCF8833 || h->proto == PROTO_MERCURY) {
-        if (h->oldpix == NULL) {
-            st2205_send_partial(h, pixinfo, 0, 0, h->width - 1, h->height - 1);
-        } else {
-            /*
-             go send incremental image
-             Algorithm: go find biggest bounding box.
-             It's semi-efficient: usually it works, but it could be that
-             dividing the difference in multiple bounding boxes works better.
-             */
-
-
-            for (x=0; x<h->width; x++) {
-                for (y=0; y<h->height; y++) {
-                    c1 = getpixel(h, pixinfo, x, y);
-                    c2 = getpixel(h, h->oldpix, x, y);
-                    if (c1 != c2) {
-                        if (x < xs)
-                            xs = x;
-                        if (y < ys)
-                            ys = y;
-                        if (x > xe)
-                            xe = x;
-                        if (y > ye)
-                            ye = y;
-                    }
-                }
-            }
+    int s, e;
 
-                         /* Sometimes there is no change. */
-            if (xs <= xe) {
-                            st2205_send_partial(h, pixinfo, xs, ys, xe, ye);
-                          }
-        }
-    } else {
-        fprintf(stderr, "libst2205: Unrecognized protocol: 0x%x!\n", h->proto);
-    }
+    for (s=0; s<len && abs(a[s] - b[s]) <= t; s++);
 
-    /*
-     Store old buffer in case we need to calculate differences next.
-     */
-    if (h->oldpix == NULL) {
-        h->oldpix = malloc(h->width*h->height*3);
+    if (s == len) {
+        *end = -1;
+        return -1;
     }
 
-    /*
-     Not to fail if malloc haven't allocated memory.
-     */
-    if (h->oldpix != NULL && xs <= xe) {
-            memcpy(h->oldpix, pixinfo, h->width*h->height*3);
-        }
+    for (e=len-1; abs(a[e] - b[e]) <= t; e--);
 
+    *end = e;
+    return s;
 }
 
-void st2205_rgba(st2205_handle *h, const unsigned char *data)
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static inline unsigned int near_mask_sse2(const unsigned char *a, const unsigned char *b, __m128i t)
 {
-    int i, pixels = h->width * h->height;
-    const unsigned char *src = data;
-    unsigned char *dest;
-
-    if (h->rgbabuf == NULL) {
-        h->rgbabuf = malloc(pixels * 3);
-        if (h->rgbabuf == NULL) return;
-    }
+    __m128i x = _mm_loadu_si128((const __m128i *)a), y = _mm_loadu_si128((const __m128i *)b);
+    __m128i d = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
 
-    dest = h->rgbabuf;
-    for (i = pixels; i > 0; i--) {
-        dest[0] = src[2];
-        dest[1] = src[1];
-        dest[2] = src[0];
-        dest += 3;
-        src += 4;
-    }
-
-    st2205_send_data(h, h->rgbabuf);
+    /* Bit set for every byte which differs by more than t */
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(d, t), _mm_setzero_si128())) & 0xffff;
 }
 
-void st2205_rgba_partial(st2205_handle *h, const unsigned char *data,
-                         int xs, int ys, int xe, int ye)
+__attribute__((target("sse2")))
+static int near_span_sse2(const unsigned char *a, const unsigned char *b, int len, int t, int *end)
 {
-    int x, rows, y, cols, pixidx, pixskip, srcskip, destskip;
-    const unsigned char *src;
-    unsigned char *dest;
+    const __m128i tt = _mm_set1_epi8((char)t);
+    int s, e;
+    unsigned int m;
 
-    if (h->rgbabuf == NULL) {
-        h->rgbabuf = malloc(h->width * h->height * 3);
-        if (h->rgbabuf == NULL) return;
+    for (s=0; s+16<=len; s+=16) {
+        m = near_mask_sse2(a+s, b+s, tt);
+        if (m != 0) {
+            s += __builtin_ctz(m);
+            goto found;
+        }
     }
 
-    cols = xe - xs + 1;
-    rows = ye - ys + 1;
+    for (; s<len && abs(a[s] - b[s]) <= t; s++);
 
-    pixidx = h->width * ys + xs;
-    pixskip = h->width - cols;
-    src = &data[pixidx * 4];
-    srcskip = pixskip * 4;
-    dest = &(h->rgbabuf[pixidx * 3]);
-    destskip = pixskip * 3;
+    if (s == len) {
+        *end = -1;
+        return -1;
+    }
 
-    for (y = rows; y != 0; y--) {
-        for (x = cols; x != 0; x--) {
-            dest[0] = src[2];
-            dest[1] = src[1];
-            dest[2] = src[0];
-            dest += 3;
-            src += 4;
+found:
+    for (e=len-16; e>=0; e-=16) {
+        m = near_mask_sse2(a+e, b+e, tt);
+        if (m != 0) {
+            *end = e + 31 - __builtin_clz(m);
+            return s;
         }
-        src += srcskip;
-        dest += destskip;
     }
 
-    st2205_send_partial(h, h->rgbabuf, xs, ys, xe, ye);
+    for (e+=15; abs(a[e] - b[e]) <= t; e--);
+
+    *end = e;
+    return s;
 }
+#endif /* HAVE_X86_SIMD */
 
 /*
- Send command to turn bl on or off
+ Convert n r,g,b pixels to 16 bpp, 5-6-5, high byte first.
  */
-void st2205_backlight(st2205_handle *h, int on)
+static void pack16_scalar(const unsigned char *src, unsigned char *dst, int n)
 {
-    if (on) {
-        h->buff[0]=CMD_BLON;
-    } else {
-        h->buff[0]=CMD_BLOFF;
-    }
+    int i;
 
-    write_stream(h, h->buff, 1);
+    for (i=0; i<n; i++) {
+        dst[0] = (src[0] & 0xf8) | (src[1] >> 5);
+        dst[1] = ((src[1] << 3) & 0xe0) | (src[2] >> 3);
+        src += 3;
+        dst += 2;
+    }
+}
+
+/*
+ Convert n r,g,b pixels to 12 bpp, two pixels in three bytes. n must be
+ even. That is just the high nibbles of the r,g,b bytes, packed in pairs.
+ */
+static void pack12_scalar(const unsigned char *src, unsigned char *dst, int n)
+{
+    int i;
+
+    for (i=0; i<n*3/2; i++) {
+        dst[i] = (src[0] & 0xf0) | (src[1] >> 4);
+        src += 2;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("ssse3")))
+static void pack16_ssse3(const unsigned char *src, unsigned char *dst, int n)
+{
+    /* Gather 16 r, g or b bytes from 48 bytes of r,g,b triplets */
+    const __m128i r0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+    const __m128i r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+    const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+    const __m128i g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+    const __m128i b0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+    const __m128i b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+    const __m128i f8 = _mm_set1_epi8((char)0xf8);
+    const __m128i e0 = _mm_set1_epi8((char)0xe0);
+    const __m128i lo3 = _mm_set1_epi8(0x07);
+    const __m128i lo5 = _mm_set1_epi8(0x1f);
+    __m128i v0, v1, v2, r, g, b, hi, lo;
+    int i;
+
+    for (i=0; i+16<=n; i+=16) {
+        v0 = _mm_loadu_si128((const __m128i *)(src));
+        v1 = _mm_loadu_si128((const __m128i *)(src+16));
+        v2 = _mm_loadu_si128((const __m128i *)(src+32));
+        r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, r0), _mm_shuffle_epi8(v1, r1)),
+                         _mm_shuffle_epi8(v2, r2));
+        g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, g0), _mm_shuffle_epi8(v1, g1)),
+                         _mm_shuffle_epi8(v2, g2));
+        b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, b0), _mm_shuffle_epi8(v1, b1)),
+                         _mm_shuffle_epi8(v2, b2));
+
+        /* There are no byte shifts, so shift words and mask */
+        hi = _mm_or_si128(_mm_and_si128(r, f8),
+                          _mm_and_si128(_mm_srli_epi16(g, 5), lo3));
+        lo = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(g, 3), e0),
+                          _mm_and_si128(_mm_srli_epi16(b, 3), lo5));
+
+        _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(dst+16), _mm_unpackhi_epi8(hi, lo));
+        src += 48;
+        dst += 32;
+    }
+
+    pack16_scalar(src, dst, n - i);
+}
+
+__attribute__((target("sse2")))
+static void pack12_sse2(const unsigned char *src, unsigned char *dst, int n)
+{
+    const __m128i hi = _mm_set1_epi16(0xf0);
+    __m128i a, b;
+    int i, len;
+
+    /* Each 16 bit word holds a pair of bytes to be packed into one */
+    len = n * 3 / 2;
+    for (i=0; i+16<=len; i+=16) {
+        a = _mm_loadu_si128((const __m128i *)(src));
+        b = _mm_loadu_si128((const __m128i *)(src+16));
+        a = _mm_or_si128(_mm_and_si128(a, hi), _mm_srli_epi16(a, 12));
+        b = _mm_or_si128(_mm_and_si128(b, hi), _mm_srli_epi16(b, 12));
+        _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(a, b));
+        src += 32;
+        dst += 16;
+    }
+
+    for (; i<len; i++) {
+        *dst++ = (src[0] & 0xf0) | (src[1] >> 4);
+        src += 2;
+    }
+}
+#endif /* HAVE_X86_SIMD */
+
+/*
+ Convert n pixels in b,g,r,a order at src to r,g,b at dst, only storing
+ pixels which differ from what is already at dst. Returns the first pixel
+ which changed and stores the last one in *end, or returns -1 if none did.
+ */
+static int rgba_row_scalar(const unsigned char *src, unsigned char *dst, int n, int *end)
+{
+    int i, s = -1, e = -1;
+
+    for (i=0; i<n; i++) {
+        if (dst[0] != src[2] || dst[1] != src[1] || dst[2] != src[0]) {
+            dst[0] = src[2];
+            dst[1] = src[1];
+            dst[2] = src[0];
+            if (s < 0)
+                s = i;
+            e = i;
+        }
+        src += 4;
+        dst += 3;
+    }
+
+    *end = e;
+    return s;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("ssse3")))
+static int rgba_row_ssse3(const unsigned char *src, unsigned char *dst, int n, int *end)
+{
+    /* Four b,g,r,a pixels to twelve r,g,b bytes at the bottom */
+    const __m128i m = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    __m128i a, b, c, d, o0, o1, o2;
+    unsigned int d0, d1, d2;
+    int i, s = -1, e = -1, s2, e2;
+
+    for (i=0; i+16<=n; i+=16) {
+        a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src)), m);
+        b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src+16)), m);
+        c = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src+32)), m);
+        d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src+48)), m);
+        o0 = _mm_or_si128(a, _mm_slli_si128(b, 12));
+        o1 = _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8));
+        o2 = _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4));
+
+        /* Bit set for every byte which differs */
+        d0 = ~_mm_movemask_epi8(_mm_cmpeq_epi8(o0, _mm_loadu_si128((const __m128i *)(dst)))) & 0xffff;
+        d1 = ~_mm_movemask_epi8(_mm_cmpeq_epi8(o1, _mm_loadu_si128((const __m128i *)(dst+16)))) & 0xffff;
+        d2 = ~_mm_movemask_epi8(_mm_cmpeq_epi8(o2, _mm_loadu_si128((const __m128i *)(dst+32)))) & 0xffff;
+
+        if (d0 | d1 | d2) {
+            _mm_storeu_si128((__m128i *)(dst), o0);
+            _mm_storeu_si128((__m128i *)(dst+16), o1);
+            _mm_storeu_si128((__m128i *)(dst+32), o2);
+            if (s < 0) {
+                s = i + (d0 ? __builtin_ctz(d0) : d1 ? 16 + __builtin_ctz(d1)
+                                                    : 32 + __builtin_ctz(d2)) / 3;
+            }
+            e = i + (d2 ? 63 - __builtin_clz(d2) : d1 ? 47 - __builtin_clz(d1)
+                                                  : 31 - __builtin_clz(d0)) / 3;
+        }
+        src += 64;
+        dst += 48;
+    }
+
+    s2 = rgba_row_scalar(src, dst, n - i, &e2);
+    if (s2 >= 0) {
+        if (s < 0)
+            s = i + s2;
+        e = i + e2;
+    }
+
+    *end = e;
+    return s;
+}
+#endif /* HAVE_X86_SIMD */
+
+/*
+ Fixed point YUV to RGB coefficients, in 64ths: luma, V for red, U and V
+ for green, U for blue. These are for limited range, with Y from 16 to 235.
+ The sums fit in 16 bits except where the result is clipped to 255 anyway.
+ */
+static const short yuv_coef[2][5] = {
+    { 75, 102, 25, 52, 129 }, /* BT.601 */
+    { 75, 115, 14, 34, 135 }, /* BT.709 */
+};
+
+static inline unsigned char clip_byte(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/*
+ Convert n pixels starting at an even pixel to r,g,b triplets. Chroma
+ samples are uvstep bytes apart, so u and v can point into one NV12 plane.
+ */
+static void yuv_row_scalar(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                           int uvstep, unsigned char *dst, int n, const short *k)
+{
+    int i, c, d, e;
+
+    for (i=0; i<n; i++) {
+        c = (y[i] - 16) * k[0] + 32;
+        d = u[(i>>1)*uvstep] - 128;
+        e = v[(i>>1)*uvstep] - 128;
+        dst[0] = clip_byte((c + k[1]*e) >> 6);
+        dst[1] = clip_byte((c - k[2]*d - k[3]*e) >> 6);
+        dst[2] = clip_byte((c + k[4]*d) >> 6);
+        dst += 3;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ Eight pixels in 16 bit lanes. Gives exactly the same results as the
+ scalar code, because saturation only happens where it would clip.
+ */
+__attribute__((target("sse2")))
+static inline void yuv8_sse2(__m128i y, __m128i d, __m128i e, const short *k,
+                             __m128i *r, __m128i *g, __m128i *b)
+{
+    const __m128i round = _mm_set1_epi16(32);
+    __m128i c;
+
+    c = _mm_adds_epi16(_mm_mullo_epi16(_mm_sub_epi16(y, _mm_set1_epi16(16)),
+                                       _mm_set1_epi16(k[0])), round);
+    *r = _mm_srai_epi16(_mm_adds_epi16(c, _mm_mullo_epi16(e, _mm_set1_epi16(k[1]))), 6);
+    *g = _mm_srai_epi16(_mm_subs_epi16(_mm_subs_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(k[2]))),
+                                       _mm_mullo_epi16(e, _mm_set1_epi16(k[3]))), 6);
+    *b = _mm_srai_epi16(_mm_adds_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(k[4]))), 6);
+}
+
+__attribute__((target("sse2")))
+static void yuv_row_sse2(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                         int uvstep, unsigned char *dst, int n, const short *k)
+{
+    const __m128i zero = _mm_setzero_si128(), bias = _mm_set1_epi16(128);
+    __m128i yy, uu, vv, d, e, r0, g0, b0, r1, g1, b1;
+    unsigned char rgb[3][16];
+    int i, j;
+
+    for (i=0; i+16<=n; i+=16) {
+        yy = _mm_loadu_si128((const __m128i *)(y + i));
+        if (uvstep == 2) {
+            uu = _mm_loadu_si128((const __m128i *)(u + i));
+            vv = _mm_srli_epi16(uu, 8);
+            uu = _mm_and_si128(uu, _mm_set1_epi16(0xff));
+        } else {
+            uu = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(u + i/2)), zero);
+            vv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(v + i/2)), zero);
+        }
+        uu = _mm_sub_epi16(uu, bias);
+        vv = _mm_sub_epi16(vv, bias);
+
+        /* Every chroma sample covers two pixels */
+        d = _mm_unpacklo_epi16(uu, uu);
+        e = _mm_unpacklo_epi16(vv, vv);
+        yuv8_sse2(_mm_unpacklo_epi8(yy, zero), d, e, k, &r0, &g0, &b0);
+        d = _mm_unpackhi_epi16(uu, uu);
+        e = _mm_unpackhi_epi16(vv, vv);
+        yuv8_sse2(_mm_unpackhi_epi8(yy, zero), d, e, k, &r1, &g1, &b1);
+
+        _mm_storeu_si128((__m128i *)rgb[0], _mm_packus_epi16(r0, r1));
+        _mm_storeu_si128((__m128i *)rgb[1], _mm_packus_epi16(g0, g1));
+        _mm_storeu_si128((__m128i *)rgb[2], _mm_packus_epi16(b0, b1));
+        for (j=0; j<16; j++) {
+            dst[0] = rgb[0][j];
+            dst[1] = rgb[1][j];
+            dst[2] = rgb[2][j];
+            dst += 3;
+        }
+    }
+
+    yuv_row_scalar(y + i, u + i/2*uvstep, v + i/2*uvstep, uvstep, dst, n - i, k);
+}
+#endif /* HAVE_X86_SIMD */
+
+/*
+ Blend n r,g,b,a pixels from src over the ones at dst, with the alpha of
+ each src pixel scaled by alpha. Divisions by 255 are rounded, using
+ (t + (t >> 8)) >> 8 for t = x + 128, which is exact for x up to 65025.
+ */
+static void blend_row_scalar(unsigned char *dst, const unsigned char *src, int n, int alpha)
+{
+    unsigned int a, t;
+    int i, c;
+
+    for (i=0; i<n; i++, src+=4, dst+=4) {
+        t = src[3] * alpha + 128;
+        a = (t + (t >> 8)) >> 8;
+        for (c=0; c<4; c++) {
+            t = src[c] * a + dst[c] * (255 - a) + 128;
+            dst[c] = (t + (t >> 8)) >> 8;
+        }
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static inline __m128i div255_sse2(__m128i t)
+{
+    t = _mm_add_epi16(t, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+/*
+ Two pixels in 16 bit lanes.
+ */
+__attribute__((target("sse2")))
+static inline __m128i blend2_sse2(__m128i d, __m128i s, __m128i alpha)
+{
+    __m128i a;
+
+    /* Every pixel's alpha in all its lanes */
+    a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+    a = div255_sse2(_mm_mullo_epi16(a, alpha));
+
+    return div255_sse2(_mm_add_epi16(_mm_mullo_epi16(s, a),
+                                     _mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), a))));
+}
+
+__attribute__((target("sse2")))
+static void blend_row_sse2(unsigned char *dst, const unsigned char *src, int n, int alpha)
+{
+    const __m128i zero = _mm_setzero_si128(), al = _mm_set1_epi16(alpha);
+    __m128i s, d;
+    int i;
+
+    for (i=0; i+4<=n; i+=4, src+=16, dst+=16) {
+        s = _mm_loadu_si128((const __m128i *)src);
+        d = _mm_loadu_si128((const __m128i *)dst);
+        d = _mm_packus_epi16(blend2_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero), al),
+                             blend2_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero), al));
+        _mm_storeu_si128((__m128i *)dst, d);
+    }
+
+    blend_row_scalar(dst, src, n - i, alpha);
+}
+#endif /* HAVE_X86_SIMD */
+
+static int (*diff_span)(const unsigned char *a, const unsigned char *b, int len, int *end) = diff_span_scalar;
+static int (*near_span)(const unsigned char *a, const unsigned char *b, int len, int t, int *end) = near_span_scalar;
+static void (*pack16)(const unsigned char *src, unsigned char *dst, int n) = pack16_scalar;
+static void (*pack12)(const unsigned char *src, unsigned char *dst, int n) = pack12_scalar;
+static int (*rgba_row)(const unsigned char *src, unsigned char *dst, int n, int *end) = rgba_row_scalar;
+static void (*yuv_row)(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                       int uvstep, unsigned char *dst, int n, const short *k) = yuv_row_scalar;
+static void (*blend_row)(unsigned char *dst, const unsigned char *src, int n, int alpha) = blend_row_scalar;
+
+/*
+ Pick the fastest kernels this CPU can run.
+ */
+static void select_kernels(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        diff_span = diff_span_sse2;
+        near_span = near_span_sse2;
+        pack12 = pack12_sse2;
+        yuv_row = yuv_row_sse2;
+        blend_row = blend_row_sse2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        pack16 = pack16_ssse3;
+        rgba_row = rgba_row_ssse3;
+    }
+    if (__builtin_cpu_supports("avx2"))
+        diff_span = diff_span_avx2;
+#endif
+}
+
+static int enddata(char *buff, int p)
+{
+    int pageaddr, offset;
+
+    offset = p & 63;
+    pageaddr = p-offset;
+
+    if (offset == 0)
+        return p;
+
+    //buff[pageaddr + 1] = offset - 1;
+    buff[pageaddr] = 0xC0 + offset - 1;
+    //fprintf(stderr, "(%i)", buff[pageaddr]);
+    p = pageaddr + 64;
+
+    return p;
+}
+
+/*
+ Sets the window. Callers pass a constant proto, so this compiles down
+ to just one case. With Mercury, a rotated window is turned into one on
+ the panel, and the LCD is told which corner writing starts from.
+ */
+static inline int pcf8833_setxy(st2205_handle *h, int proto, char *buff, int p, int xs, int xe, int ys, int ye)
+{
+    int xsoff = xs + h->offx;
+    int xeoff = xe + h->offx;
+
+    p = enddata(buff, p);
+
+    if (proto == PROTO_MERCURY && h->orient != 0) {
+        /* Panel size, and window on the panel with the start corner */
+        int pw = h->orient & 1 ? h->height : h->width;
+        int ph = h->orient & 1 ? h->width : h->height;
+        int pxs, pxe, pys, pye, sx, sy;
+
+        switch (h->orient) {
+        case 1: /* 90 */
+            pxs = ys; pxe = ye;
+            pys = ph-1-xe; pye = ph-1-xs;
+            sx = pxs; sy = pye;
+            break;
+        case 2: /* 180 */
+            pxs = pw-1-xe; pxe = pw-1-xs;
+            pys = ph-1-ye; pye = ph-1-ys;
+            sx = pxe; sy = pye;
+            break;
+        default: /* 270 */
+            pxs = pw-1-ye; pxe = pw-1-ys;
+            pys = xs; pye = xe;
+            sx = pxe; sy = pys;
+            break;
+        }
+        pxs += h->offx;
+        pxe += h->offx;
+        sx += h->offx;
+
+        buff[p] = CMD_SETWINADDR;
+        buff[p+1] = (pxs & 0xff00) >> 8;
+        buff[p+2] = (pxs & 0xff);
+        buff[p+3] = (pxe & 0xff00) >> 8;
+        buff[p+4] = (pxe & 0xff);
+        buff[p+5] = pys + h->offy;
+        buff[p+6] = pye + h->offy;
+        buff[p+7] = (sx & 0xff00) >> 8;
+        buff[p+8] = (sx & 0xff);
+        buff[p+9] = sy + h->offy;
+        return p + 64;
+    }
+
+    switch (proto) {
+    case PROTO_PCF8833:
+        buff[p] = 1;
+        buff[p+1] = xsoff;
+        buff[p+2] = xeoff;
+        buff[p+3] = ys + h->offy;
+        buff[p+4] = ye + h->offy;
+        break;
+
+    case PROTO_MERCURY:
+        buff[p] = CMD_SETWIN;
+        buff[p+1] = (xsoff & 0xff00) >> 8;
+        buff[p+2] = (xsoff & 0xff);
+        buff[p+3] = (xeoff & 0xff00) >> 8;
+        buff[p+4] = (xeoff & 0xff);
+        buff[p+5] = ys + h->offy;
+        buff[p+6] = ye + h->offy;
+        break;
+    }
+
+    p += 64;
+    return p;
+}
+
+/*
+ Append n bytes to the packets at p. Every packet is started as a full one,
+ with 63 bytes, and enddata() fixes up the last one.
+ */
+static int putdata(char *buff, int p, const unsigned char *src, int n)
+{
+    int len;
+
+    while (n > 0) {
+        if ((p&63) == 0) {
+            buff[p] = 0xC0 + 63 - 1;
+            p++;
+        }
+
+        len = 64 - (p&63);
+        if (len > n)
+            len = n;
+
+        memcpy(buff + p, src, len);
+        p += len;
+        src += len;
+        n -= len;
+    }
+
+    return p;
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static int64_t now_us(void)
+{
+    return now_ns() / 1000;
+}
+
+/*
+ Link model: a write of n bytes takes write_ns + n * byte_ps / 1000
+ nanoseconds. Every write is timed, and the model is fitted to recent
+ writes by least squares, with each write counting 1/32 less than the one
+ after. Until writes of different sizes were seen, only write_ns is
+ fitted, and before any were, the guesses below are used.
+ */
+#define LINK_WRITE_NS 1000000
+#define LINK_BYTE_PS  1000000
+#define LINK_DECAY    (31.0 / 32.0)
+
+struct st2205_link {
+    /* Decayed sums of 1, bytes, ns, bytes^2 and bytes*ns */
+    double n, x, y, xx, xy;
+    int write_ns;
+    int byte_ps;
+};
+
+static void link_sample(st2205_handle *h, int bytes, int64_t ns)
+{
+    struct st2205_link *l = h->link;
+    double d, slope, icpt;
+
+    if (l == NULL)
+        return;
+
+    l->n  = l->n  * LINK_DECAY + 1;
+    l->x  = l->x  * LINK_DECAY + bytes;
+    l->y  = l->y  * LINK_DECAY + ns;
+    l->xx = l->xx * LINK_DECAY + (double)bytes * bytes;
+    l->xy = l->xy * LINK_DECAY + (double)bytes * ns;
+
+    /* Sizes have to spread by more than a sector to say much */
+    slope = __atomic_load_n(&l->byte_ps, __ATOMIC_RELAXED) / 1000.0;
+    d = l->n * l->xx - l->x * l->x;
+    if (d > l->n * l->n * 512.0 * 512.0 && l->n * l->xy - l->x * l->y > 0)
+        slope = (l->n * l->xy - l->x * l->y) / d;
+    icpt = (l->y - slope * l->x) / l->n;
+    if (icpt < 0)
+        icpt = 0;
+
+    __atomic_store_n(&l->byte_ps, (int)(slope * 1000 + 0.5), __ATOMIC_RELAXED);
+    __atomic_store_n(&l->write_ns, icpt < INT32_MAX ? (int)icpt : INT32_MAX, __ATOMIC_RELAXED);
+}
+
+/*
+ Predicted microseconds for sending bytes in writes writes.
+ */
+static long link_us(st2205_handle *h, long bytes, int writes)
+{
+    int64_t write_ns = LINK_WRITE_NS, byte_ps = LINK_BYTE_PS;
+
+    if (h->link != NULL) {
+        write_ns = __atomic_load_n(&h->link->write_ns, __ATOMIC_RELAXED);
+        byte_ps = __atomic_load_n(&h->link->byte_ps, __ATOMIC_RELAXED);
+    }
+
+    return (writes * write_ns + bytes * byte_ps / 1000 + 500) / 1000;
+}
+
+/*
+ How many bytes one write can send in us microseconds, in whole sectors,
+ and at least one.
+ */
+static int link_bytes(st2205_handle *h, long us)
+{
+    int64_t write_ns = LINK_WRITE_NS, byte_ps = LINK_BYTE_PS, bytes;
+
+    if (h->link != NULL) {
+        write_ns = __atomic_load_n(&h->link->write_ns, __ATOMIC_RELAXED);
+        byte_ps = __atomic_load_n(&h->link->byte_ps, __ATOMIC_RELAXED);
+    }
+    if (byte_ps < 1)
+        byte_ps = 1;
+
+    bytes = ((int64_t)us * 1000 - write_ns) * 1000 / byte_ps;
+    if (bytes > INT32_MAX)
+        bytes = INT32_MAX;
+    return bytes < 512 ? 512 : (int)(bytes & ~511);
+}
+
+static int write_stream(st2205_handle *h, char *buff, int len)
+{
+    int64_t t;
+
+    /*
+     Pad to 512-byte boundary, with 0xff
+     */
+    for(; len%512; len++) {
+        buff[len] = 0;
+    }
+
+    //DPRINT("Writing 0x%x bytes.\n",len);
+
+    h->yuvkey = 0;
+    h->progpass = 0;
+
+    t = now_ns();
+    len = dev_write(h->fd, h->sgmax, POS_WDAT, buff, len);
+    if (len > 0)
+        link_sample(h, len, now_ns() - t);
+
+    return len;
+}
+
+/*
+ Pixels converted per step for the 12 and 16 bpp modes. Must be even.
+ */
+#define PACK_PIXELS 512
+
+/*
+ Encodes rows of w pixels, stride bytes apart, from r,g,b triplets at src.
+ Returns the position after the data, which may end in a partial packet.
+ This is a template: it is only called with a constant bpp.
+ */
+static inline __attribute__((always_inline))
+int encode_rows_tmpl(const int bpp, char *buff, int p, const unsigned char *src, int stride, int w, int rows)
+{
+    unsigned char tmp[PACK_PIXELS * 3];
+    int x, y, n;
+
+    switch (bpp) {
+    case 24:
+        if (stride == w * 3) {
+            /* Contiguous rows, like full width ones */
+            p = putdata(buff, p, src, rows * stride);
+        } else {
+            for (y=0; y<rows; y++)
+                p = putdata(buff, p, src + y * stride, w * 3);
+        }
+        break;
+
+    case 16:
+        for (y=0; y<rows; y++, src+=stride) {
+            for (x=0; x<w; x+=n) {
+                n = w - x < PACK_PIXELS ? w - x : PACK_PIXELS;
+                pack16(src + x * 3, tmp, n);
+                p = putdata(buff, p, tmp, n * 2);
+            }
+        }
+        break;
+
+    case 12:
+        /* An odd width gets a black pixel added at the end */
+        for (y=0; y<rows; y++, src+=stride) {
+            for (x=0; x<w; x+=n) {
+                n = w - x < PACK_PIXELS ? w - x : PACK_PIXELS;
+                if (n & 1) {
+                    memcpy(tmp, src + x * 3, n * 3);
+                    memset(tmp + n * 3, 0, 3);
+                    pack12(tmp, tmp, n + 1);
+                    p = putdata(buff, p, tmp, (n + 1) * 3 / 2);
+                } else {
+                    pack12(src + x * 3, tmp, n);
+                    p = putdata(buff, p, tmp, n * 3 / 2);
+                }
+            }
+        }
+        break;
+    }
+
+    return p;
+}
+
+/*
+ Encodes image (xs,ys)-(xe,ye), inclusive, starting at position p in buff.
+ Returns the position after the last packet. This is a template: it is
+ only called with constant proto and bpp, by the ENCODER() functions below.
+ */
+static inline __attribute__((always_inline))
+int encode_rect_tmpl(st2205_handle *h, const int proto, const int bpp, char *buff, int p,
+                     unsigned char *pixinfo, int xs, int ys, int xe, int ye)
+{
+    int w, rowbytes;
+
+    if (xs < 0)
+        xs = 0;
+    if (ys < 0)
+        ys = 0;
+    if (xe >= (int)h->width)
+        xe = h->width - 1;
+    if (ye >= (int)h->height)
+        ye = h->height - 1;
+
+    /*
+     bpp=12, make width and xstart even
+     */
+    if (bpp == 12) {
+        xs-=(xs&1);
+        xe+=(xe-xs+1)&1;
+    }
+
+    p = pcf8833_setxy(h, proto, buff, p, xs, xe, ys, ye);
+
+    w = xe - xs + 1;
+    rowbytes = h->width * 3;
+
+    /*
+     With an odd width, the 12 bpp pair at the right edge has
+     a pixel past the end. It gets sent as black.
+     */
+    if (w > 0 && xe >= (int)h->width)
+        w--;
+
+    if (w <= 0 || ys > ye)
+        return p;
+
+    p = encode_rows_tmpl(bpp, buff, p, pixinfo + ys * rowbytes + xs * 3, rowbytes, w, ye - ys + 1);
+
+    return enddata(buff, p);
+}
+
+typedef int (*encode_func)(st2205_handle *h, char *buff, int p, unsigned char *pixinfo,
+                           int xs, int ys, int xe, int ye);
+typedef int (*setwin_func)(st2205_handle *h, char *buff, int p, int xs, int xe, int ys, int ye);
+typedef int (*rows_func)(char *buff, int p, const unsigned char *src, int stride, int w, int rows);
+
+#define ENCODER(proto, bpp) \
+static int encode_##proto##_##bpp(st2205_handle *h, char *buff, int p, unsigned char *pixinfo, \
+                                  int xs, int ys, int xe, int ye) \
+{ \
+    return encode_rect_tmpl(h, PROTO_##proto, bpp, buff, p, pixinfo, xs, ys, xe, ye); \
+}
+
+#define SETWIN(proto) \
+static int setwin_##proto(st2205_handle *h, char *buff, int p, int xs, int xe, int ys, int ye) \
+{ \
+    return pcf8833_setxy(h, PROTO_##proto, buff, p, xs, xe, ys, ye); \
+}
+
+#define ROWS(bpp) \
+static int rows_##bpp(char *buff, int p, const unsigned char *src, int stride, int w, int rows) \
+{ \
+    return encode_rows_tmpl(bpp, buff, p, src, stride, w, rows); \
+}
+
+ENCODER(PCF8833, 12)
+ENCODER(PCF8833, 16)
+ENCODER(PCF8833, 24)
+ENCODER(MERCURY, 12)
+ENCODER(MERCURY, 16)
+ENCODER(MERCURY, 24)
+SETWIN(PCF8833)
+SETWIN(MERCURY)
+ROWS(12)
+ROWS(16)
+ROWS(24)
+
+/*
+ encode does a whole rect. setwin and rows are the parts of it,
+ for callers which supply pixels some other way.
+ */
+struct st2205_encoder {
+    int proto;
+    int bpp;
+    encode_func encode;
+    setwin_func setwin;
+    rows_func rows;
+};
+
+static const struct st2205_encoder encoders[] = {
+    { PROTO_PCF8833, 12, encode_PCF8833_12, setwin_PCF8833, rows_12 },
+    { PROTO_PCF8833, 16, encode_PCF8833_16, setwin_PCF8833, rows_16 },
+    { PROTO_PCF8833, 24, encode_PCF8833_24, setwin_PCF8833, rows_24 },
+    { PROTO_MERCURY, 12, encode_MERCURY_12, setwin_MERCURY, rows_12 },
+    { PROTO_MERCURY, 16, encode_MERCURY_16, setwin_MERCURY, rows_16 },
+    { PROTO_MERCURY, 24, encode_MERCURY_24, setwin_MERCURY, rows_24 },
+};
+
+/*
+ Points h->enc at the encoder for the display. Returns -1 if there is none.
+ */
+static int bind_encoder(st2205_handle *h)
+{
+    unsigned int i;
+
+    for (i=0; i<sizeof(encoders)/sizeof(encoders[0]); i++) {
+        if (encoders[i].proto == h->proto && encoders[i].bpp == h->bpp) {
+            h->enc = &encoders[i];
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "libst2205: Unsupported display: protocol 0x%x, %i bpp\n", h->proto, h->bpp);
+    return -1;
+}
+
+/*
+ Returns the encoder for the display, or NULL if there is none.
+ */
+static const struct st2205_encoder *get_encoder(st2205_handle *h)
+{
+    /* Someone changed bpp or proto in the handle, like setpic -test does */
+    if (h->enc->proto != h->proto || h->enc->bpp != h->bpp) {
+        if (bind_encoder(h) < 0)
+            return NULL;
+    }
+
+    return h->enc;
+}
+
+static int encode_rect(st2205_handle *h, char *buff, int p, unsigned char *pixinfo, int xs, int ys, int xe, int ye)
+{
+    const struct st2205_encoder *enc = get_encoder(h);
+
+    if (enc == NULL)
+        return p;
+
+    return enc->encode(h, buff, p, pixinfo, xs, ys, xe, ye);
+}
+
+/*
+ Number of bytes a window of the given size costs on the wire: one packet
+ for setting the window, and then the pixel data, 63 bytes per packet.
+ */
+static int rect_cost(st2205_handle *h, int xs, int xe, int rows)
+{
+    long bytes;
+
+    if (h->bpp == 12) {
+        xs-=(xs&1);
+        xe+=(xe-xs+1)&1;
+    }
+
+    bytes = (long)(xe - xs + 1) * rows * h->bpp / 8;
+
+    return 64 + (bytes + 62) / 63 * 64;
+}
+
+static int rects_cost(st2205_handle *h, const st2205_rect *rects, int n)
+{
+    int i, cost = 0;
+
+    for (i=0; i<n; i++)
+        cost += rect_cost(h, rects[i].xs, rects[i].xe, rects[i].ye - rects[i].ys + 1);
+
+    return cost;
+}
+
+/*
+ First and last byte which differ by more than t, or -1.
+ */
+static inline int change_span(const unsigned char *a, const unsigned char *b, int len, int t, int *end)
+{
+    if (t == 0)
+        return diff_span(a, b, len, end);
+    return near_span(a, b, len, t, end);
+}
+
+/*
+ Finds the first and last pixel in every row with a color component more
+ than t away from oldpix, going through both buffers once in memory order.
+ Rows without changes get first = -1. Returns the number of changed rows.
+ */
+static int diff_rows(st2205_handle *h, const void *arg, int t, int *first, int *last)
+{
+    const unsigned char *pixinfo = arg;
+    unsigned int y;
+    int s, e, rowbytes, changed = 0;
+
+    rowbytes = h->width * 3;
+
+    for (y=0; y<h->height; y++) {
+        s = change_span(pixinfo + y * rowbytes, h->oldpix + y * rowbytes, rowbytes, t, &e);
+
+        if (s < 0) {
+            first[y] = -1;
+            continue;
+        }
+
+        first[y] = s / 3;
+        last[y] = e / 3;
+        changed++;
+    }
+
+    return changed;
+}
+
+/*
+ Turns per-row changes into a set of windows covering them, each spanning
+ all columns changed in its rows. Since every window costs a packet, it
+ pays to merge nearby changes and to split distant ones. The split is chosen
+ to minimize bytes on the wire, and then the cheapest merges are made until
+ there are at most max windows. Returns the number of windows.
+ */
+static int plan_rects(st2205_handle *h, const int *first, const int *last, st2205_rect *rects, int max)
+{
+    int *row, *best, *from;
+    st2205_rect *tmp, u;
+    int a, b, i, n, c, xs, xe, merge, extra, mergeextra;
+
+    n = 0;
+    row = malloc(sizeof(int) * (h->height * 3 + 1));
+    tmp = malloc(sizeof(st2205_rect) * h->height);
+    if (row == NULL || tmp == NULL) {
+        free(row);
+        free(tmp);
+        rects[0].xs = 0;
+        rects[0].ys = 0;
+        rects[0].xe = h->width - 1;
+        rects[0].ye = h->height - 1;
+        return 1;
+    }
+    best = row + h->height;
+    from = best + h->height + 1;
+
+    for (a=0; a<(int)h->height; a++) {
+        if (first[a] >= 0)
+            row[n++] = a;
+    }
+
+    /*
+     best[b] is the cost of covering the first b changed rows, with
+     the last window starting at changed row from[b].
+     */
+    best[0] = 0;
+    for (b=0; b<n; b++) {
+        xs = h->width;
+        xe = -1;
+        best[b+1] = -1;
+        for (a=b; a>=0; a--) {
+            if (first[row[a]] < xs)
+                xs = first[row[a]];
+            if (last[row[a]] > xe)
+                xe = last[row[a]];
+            c = best[a] + rect_cost(h, xs, xe, row[b] - row[a] + 1);
+            if (best[b+1] < 0 || c < best[b+1]) {
+                best[b+1] = c;
+                from[b+1] = a;
+            }
+        }
+    }
+
+    /*
+     Walk back through the choices, filling in windows from the end.
+     */
+    c = 0;
+    for (b=n; b>0; b=from[b])
+        c++;
+
+    i = c;
+    for (b=n; b>0; b=from[b]) {
+        i--;
+        tmp[i].xs = h->width;
+        tmp[i].xe = -1;
+        for (a=from[b]; a<b; a++) {
+            if (first[row[a]] < tmp[i].xs)
+                tmp[i].xs = first[row[a]];
+            if (last[row[a]] > tmp[i].xe)
+                tmp[i].xe = last[row[a]];
+        }
+        tmp[i].ys = row[from[b]];
+        tmp[i].ye = row[b-1];
+    }
+
+    /*
+     Merge neighbours while there are too many windows, picking the merge
+     which adds the fewest bytes each time.
+     */
+    while (c > max) {
+        merge = 0;
+        mergeextra = -1;
+        for (i=0; i<c-1; i++) {
+            xs = tmp[i].xs < tmp[i+1].xs ? tmp[i].xs : tmp[i+1].xs;
+            xe = tmp[i].xe > tmp[i+1].xe ? tmp[i].xe : tmp[i+1].xe;
+            extra = rect_cost(h, xs, xe, tmp[i+1].ye - tmp[i].ys + 1)
+                    - rect_cost(h, tmp[i].xs, tmp[i].xe, tmp[i].ye - tmp[i].ys + 1)
+                    - rect_cost(h, tmp[i+1].xs, tmp[i+1].xe, tmp[i+1].ye - tmp[i+1].ys + 1);
+            if (mergeextra < 0 || extra < mergeextra) {
+                merge = i;
+                mergeextra = extra;
+            }
+        }
+
+        u = tmp[merge];
+        if (tmp[merge+1].xs < u.xs)
+            u.xs = tmp[merge+1].xs;
+        if (tmp[merge+1].xe > u.xe)
+            u.xe = tmp[merge+1].xe;
+        u.ye = tmp[merge+1].ye;
+        tmp[merge] = u;
+        memmove(&tmp[merge+1], &tmp[merge+2], sizeof(st2205_rect) * (c - merge - 2));
+        c--;
+    }
+
+    memcpy(rects, tmp, sizeof(st2205_rect) * c);
+    free(tmp);
+    free(row);
+
+    return c;
+}
+
+typedef int (*diff_func)(st2205_handle *h, const void *arg, int t, int *first, int *last);
+
+/*
+ Plans rects for the changes diff() finds above the lossy threshold. With
+ a budget, the threshold is raised for this frame until the rects cost no
+ more than that, so a noisy frame sends only its biggest changes. What is
+ not sent stays in oldpix as it was, so errors don't build up.
+ */
+static int plan_lossy(st2205_handle *h, diff_func diff, const void *arg,
+                      int *first, int *last, st2205_rect *rects, int max)
+{
+    int i, n, cost, t = h->lossy;
+
+    for (;;) {
+        n = 0;
+        if (diff(h, arg, t, first, last) > 0)
+            n = plan_rects(h, first, last, rects, max);
+
+        if (h->lossy_budget <= 0 || t >= 255)
+            return n;
+
+        cost = 0;
+        for (i=0; i<n; i++)
+            cost += rect_cost(h, rects[i].xs, rects[i].xe, rects[i].ye - rects[i].ys + 1);
+        if (cost <= h->lossy_budget)
+            return n;
+
+        t = t * 2 + 1 < 255 ? t * 2 + 1 : 255;
+    }
+}
+
+/*
+ Tile hashing. Rather than keeping the previous frame, only a hash of every
+ TILE_SIZE square is kept, and tiles with a different hash get resent.
+ */
+#define TILE_SIZE 16
+
+static unsigned int tiles_x(st2205_handle *h)
+{
+    return (h->width + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+static unsigned int tiles_y(st2205_handle *h)
+{
+    return (h->height + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+#define HASH_P1 0x9E3779B185EBCA87ULL
+#define HASH_P2 0xC2B2AE3D27D4EB4FULL
+
+static uint64_t hash_bytes(uint64_t acc, const unsigned char *p, int n)
+{
+    uint64_t w;
+
+    while (n > 0) {
+        w = 0;
+        memcpy(&w, p, n < 8 ? n : 8);
+        acc += w * HASH_P2;
+        acc = (acc << 31) | (acc >> 33);
+        acc *= HASH_P1;
+        p += 8;
+        n -= 8;
+    }
+
+    return acc;
+}
+
+static uint64_t hash_final(uint64_t acc)
+{
+    acc ^= acc >> 33;
+    acc *= HASH_P2;
+    acc ^= acc >> 29;
+    acc *= HASH_P1;
+    acc ^= acc >> 32;
+
+    /* 0 is reserved for tiles with unknown contents */
+    return acc | 1;
+}
+
+/*
+ Hash of the whole frame, made from the hashes of its tiles.
+ */
+static uint64_t hash_frame(const uint64_t *hash, unsigned int nt)
+{
+    return hash_final(hash_bytes(0, (const unsigned char *)hash, nt * sizeof(uint64_t)));
+}
+
+/*
+ Hashes every tile of the frame into hash[], going through the frame in
+ memory order, and returns the hash of the whole frame.
+ */
+static uint64_t hash_tiles(st2205_handle *h, const unsigned char *pixinfo, uint64_t *hash)
+{
+    unsigned int tx, ty, y, ye, ntx, rowbytes, len;
+    const unsigned char *row;
+    uint64_t *acc;
+
+    ntx = tiles_x(h);
+    rowbytes = h->width * 3;
+
+    for (ty=0; ty<tiles_y(h); ty++) {
+        acc = hash + ty * ntx;
+        for (tx=0; tx<ntx; tx++)
+            acc[tx] = tx + ty * ntx;
+
+        ye = (ty + 1) * TILE_SIZE;
+        if (ye > h->height)
+            ye = h->height;
+
+        for (y=ty*TILE_SIZE; y<ye; y++) {
+            row = pixinfo + y * rowbytes;
+            for (tx=0; tx<ntx; tx++) {
+                len = rowbytes - tx * TILE_SIZE * 3;
+                if (len > TILE_SIZE * 3)
+                    len = TILE_SIZE * 3;
+                acc[tx] = hash_bytes(acc[tx], row + tx * TILE_SIZE * 3, len);
+            }
+        }
+
+        for (tx=0; tx<ntx; tx++)
+            acc[tx] = hash_final(acc[tx]);
+    }
+
+    return hash_frame(hash, ntx * tiles_y(h));
+}
+
+/*
+ Like diff_rows(), but at tile granularity, using the hashes of what
+ was last sent. The hashes of this frame are stored after those, and
+ if the hash of the whole frame is the same, nothing else is looked at.
+ */
+static int diff_tiles(st2205_handle *h, const unsigned char *pixinfo, int *first, int *last)
+{
+    unsigned int tx, ty, y, ntx, nt;
+    int changed = 0, s, e;
+    uint64_t *newhash;
+
+    ntx = tiles_x(h);
+    nt = ntx * tiles_y(h);
+    newhash = h->tilehash + nt;
+
+    if (hash_tiles(h, pixinfo, newhash) == h->framehash)
+        return 0;
+
+    for (ty=0; ty<tiles_y(h); ty++) {
+        s = -1;
+        e = -1;
+        for (tx=0; tx<ntx; tx++) {
+            if (newhash[ty * ntx + tx] != h->tilehash[ty * ntx + tx]) {
+                if (s < 0)
+                    s = tx * TILE_SIZE;
+                e = tx * TILE_SIZE + TILE_SIZE - 1;
+            }
+        }
+
+        if (e >= (int)h->width)
+            e = h->width - 1;
+
+        for (y=ty*TILE_SIZE; y<(ty+1)*TILE_SIZE && y<h->height; y++) {
+            first[y] = s;
+            last[y] = e;
+            if (s >= 0)
+                changed++;
+        }
+    }
+
+    return changed;
+}
+
+/*
+ Is there anything to compare new frames against?
+ */
+static int have_reference(st2205_handle *h)
+{
+    if (h->damage_mode == ST2205_DAMAGE_TILES)
+        return h->tilehash != NULL;
+    else
+        return h->oldpix != NULL;
+}
+
+int st2205_find_damage(st2205_handle *h, unsigned char *pixinfo, st2205_rect *rects, int max)
+{
+    int *first, n;
+
+    if (max <= 0)
+        return 0;
+
+    if (!have_reference(h)) {
+        rects[0].xs = 0;
+        rects[0].ys = 0;
+        rects[0].xe = h->width - 1;
+        rects[0].ye = h->height - 1;
+        return 1;
+    }
+
+    first = malloc(sizeof(int) * h->height * 2);
+    if (first == NULL) {
+        rects[0].xs = 0;
+        rects[0].ys = 0;
+        rects[0].xe = h->width - 1;
+        rects[0].ye = h->height - 1;
+        return 1;
+    }
+
+    n = 0;
+    if (h->damage_mode == ST2205_DAMAGE_TILES) {
+        if (diff_tiles(h, pixinfo, first, first + h->height) > 0)
+            n = plan_rects(h, first, first + h->height, rects, max);
+    } else {
+        n = plan_lossy(h, diff_rows, pixinfo, first, first + h->height, rects, max);
+    }
+
+    free(first);
+
+    return n;
+}
+
+/*
+ Header of a state file, followed by the shadow at STATE_PIXELS. gen is
+ odd while a process has the file open, so a state left behind by a
+ process that didn't get to st2205_close() is never trusted.
+ */
+#define STATE_MAGIC "ST2205S1"
+#define STATE_PIXELS 4096
+
+struct st2205_state {
+    char magic[8];
+    uint32_t gen;
+    uint32_t valid;
+    uint32_t width;
+    uint32_t height;
+    int32_t bpp;
+    int32_t proto;
+    char key[256];
+    int32_t orient;     /* Zero in files from before rotation */
+};
+
+/*
+ The shadow lives in the state file if there is one.
+ */
+static unsigned char *shadow_alloc(st2205_handle *h)
+{
+    if (h->state != NULL)
+        return (unsigned char *)h->state + STATE_PIXELS;
+    return malloc(h->width * h->height * 3);
+}
+
+static void shadow_free(st2205_handle *h)
+{
+    if (h->state == NULL)
+        free(h->oldpix);
+    h->oldpix = NULL;
+}
+
+/*
+ Notes that (xs,ys)-(xe,ye) of pixinfo was sent to the display. With a
+ previous frame in oldpix, that part is copied there. With tile hashes, the
+ tiles it touches are marked as unknown, because they may be only partly
+ covered.
+ */
+static void track_rect(st2205_handle *h, const unsigned char *pixinfo, int xs, int ys, int xe, int ye)
+{
+    unsigned int tx, ty, ntx;
+    int y;
+
+    if (xs < 0)
+        xs = 0;
+    if (ys < 0)
+        ys = 0;
+    if (xe >= (int)h->width)
+        xe = h->width - 1;
+    if (ye >= (int)h->height)
+        ye = h->height - 1;
+    if (xs > xe || ys > ye)
+        return;
+
+    if (h->damage_mode == ST2205_DAMAGE_TILES) {
+        if (h->tilehash == NULL)
+            return;
+        ntx = tiles_x(h);
+        for (ty=ys/TILE_SIZE; ty<=(unsigned int)ye/TILE_SIZE; ty++)
+            for (tx=xs/TILE_SIZE; tx<=(unsigned int)xe/TILE_SIZE; tx++)
+                h->tilehash[ty * ntx + tx] = 0;
+        h->framehash = 0;
+    } else if (h->oldpix != NULL && h->oldpix != pixinfo) {
+        for (y=ys; y<=ye; y++) {
+            memcpy(h->oldpix + (y * h->width + xs) * 3,
+                   pixinfo + (y * h->width + xs) * 3, (xe - xs + 1) * 3);
+        }
+    }
+}
+
+/*
+ Notes that pixinfo is now on the display, after sending the rects
+ st2205_find_damage() found in it.
+ */
+static void track_frame(st2205_handle *h, const unsigned char *pixinfo, const st2205_rect *rects, int n)
+{
+    unsigned int nt;
+    int i;
+
+    if (h->damage_mode == ST2205_DAMAGE_TILES) {
+        nt = tiles_x(h) * tiles_y(h);
+        if (h->tilehash == NULL) {
+            h->tilehash = malloc(sizeof(uint64_t) * nt * 2);
+            if (h->tilehash == NULL)
+                return;
+            h->framehash = hash_tiles(h, pixinfo, h->tilehash);
+        } else if (n > 0) {
+            /* diff_tiles() left the new hashes after the old ones */
+            memcpy(h->tilehash, h->tilehash + nt, sizeof(uint64_t) * nt);
+            h->framehash = hash_frame(h->tilehash, nt);
+        }
+        return;
+    }
+
+    /*
+     Store old buffer in case we need to calculate differences next.
+     Not to fail if malloc haven't allocated memory.
+     */
+    if (h->oldpix == NULL) {
+        h->oldpix = shadow_alloc(h);
+        if (h->oldpix != NULL)
+            memcpy(h->oldpix, pixinfo, h->width*h->height*3);
+        return;
+    }
+
+    for (i=0; i<n; i++)
+        track_rect(h, pixinfo, rects[i].xs, rects[i].ys, rects[i].xe, rects[i].ye);
+}
+
+void st2205_set_damage_mode(st2205_handle *h, int mode)
+{
+    if (mode == h->damage_mode ||
+        (mode != ST2205_DAMAGE_EXACT && mode != ST2205_DAMAGE_TILES))
+        return;
+
+    st2205_invalidate(h);
+    h->damage_mode = mode;
+}
+
+void st2205_set_lossy(st2205_handle *h, int threshold, int budget)
+{
+    h->lossy = threshold < 0 ? 0 : threshold > 255 ? 255 : threshold;
+    h->lossy_budget = budget;
+}
+
+void st2205_invalidate(st2205_handle *h)
+{
+    shadow_free(h);
+    free(h->tilehash);
+    h->tilehash = NULL;
+    h->framehash = 0;
+    free(h->yuvpix);
+    h->yuvpix = NULL;
+    h->progpass = 0;
+}
+
+/*
+ Output of encoded packets. Data goes into out->buff, and when a rect
+ doesn't fit, whole sectors are written and the rest moved to the start,
+ so the stream on the wire is the same however it is split. Normally the
+ buffer is h->buff, which fits any frame. In streaming mode, it is one
+ of a ring of small chunks, which a writer thread writes while the next
+ one is encoded.
+ */
+#define STREAM_CHUNKS 4
+#define STREAM_CHUNK  16384
+
+struct out {
+    st2205_handle *h;
+    char *buff;
+    int p;
+    int size;
+};
+
+#ifdef __linux__
+struct st2205_stream {
+    char *mem;
+    int len[STREAM_CHUNKS];
+    int head;   /* Chunk being filled */
+    int queued; /* Chunks before head, waiting to be written */
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void *stream_thread(void *arg)
+{
+    st2205_handle *h = arg;
+    struct st2205_stream *s = h->stream;
+    int i;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!s->queued && !s->stop)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (!s->queued)
+            break;
+
+        i = (s->head - s->queued + STREAM_CHUNKS) % STREAM_CHUNKS;
+        pthread_mutex_unlock(&s->lock);
+
+        write_stream(h, s->mem + i * STREAM_CHUNK, s->len[i]);
+
+        pthread_mutex_lock(&s->lock);
+        s->queued--;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+/*
+ Queues len bytes of the chunk being filled, and returns the next one
+ once it is free. With wait set, returns once everything is written.
+ */
+static char *stream_submit(struct st2205_stream *s, int len, int wait)
+{
+    pthread_mutex_lock(&s->lock);
+    s->len[s->head] = len;
+    s->head = (s->head + 1) % STREAM_CHUNKS;
+    s->queued++;
+    pthread_cond_broadcast(&s->cond);
+    while (wait ? s->queued > 0 : s->queued == STREAM_CHUNKS)
+        pthread_cond_wait(&s->cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+
+    return s->mem + s->head * STREAM_CHUNK;
+}
+
+static void stream_stop(st2205_handle *h)
+{
+    struct st2205_stream *s = h->stream;
+
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+
+    h->stream = NULL;
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    free_aligned(s->mem, STREAM_CHUNKS * STREAM_CHUNK);
+    free(s);
+}
+#endif /* __linux__ */
+
+#ifdef __linux__
+/*
+ How much goes in a chunk. Every write costs some time whatever its size,
+ so chunks are made big enough for that to be no more than an eighth of
+ the time they take, and otherwise small, so writing starts early. The
+ ring stays small, so on a slow link, that is as much as fits.
+ */
+static int stream_chunk(st2205_handle *h)
+{
+    int n = link_bytes(h, link_us(h, 0, 8));
+
+    return n < 4096 ? 4096 : n > STREAM_CHUNK ? STREAM_CHUNK : n;
+}
+#endif
+
+static void out_begin(st2205_handle *h, struct out *o)
+{
+    o->h = h;
+    o->p = 0;
+#ifdef __linux__
+    if (h->stream != NULL) {
+        o->buff = h->stream->mem + h->stream->head * STREAM_CHUNK;
+        o->size = stream_chunk(h);
+        return;
+    }
+#endif
+    o->buff = h->buff;
+    o->size = BUFF_SIZE;
+}
+
+/*
+ Makes sure there is room for need more bytes.
+ */
+static void out_room(struct out *o, int need)
+{
+    char *next = o->buff;
+    int n;
+
+    if (o->p + need <= o->size)
+        return;
+
+    n = o->p & ~511;
+#ifdef __linux__
+    if (o->h->stream != NULL) {
+        next = stream_submit(o->h->stream, n, 0);
+        memcpy(next, o->buff + n, o->p - n);
+    } else
+#endif
+    {
+        write_stream(o->h, o->buff, n);
+        memmove(o->buff, o->buff + n, o->p - n);
+    }
+    o->buff = next;
+    o->p -= n;
+}
+
+static void out_end(struct out *o)
+{
+    if (o->p == 0)
+        return;
+
+#ifdef __linux__
+    if (o->h->stream != NULL) {
+        stream_submit(o->h->stream, o->p, 1);
+        return;
+    }
+#endif
+    write_stream(o->h, o->buff, o->p);
+}
+
+/*
+ Encodes (xs,ys)-(xe,ye), inclusive, in one go if it fits, or else a few
+ rows at a time.
+ */
+static void out_rect(struct out *o, unsigned char *pixinfo, int xs, int ys, int xe, int ye)
+{
+    st2205_handle *h = o->h;
+    const struct st2205_encoder *enc;
+    int w, y, k, n, rowbytes;
+
+    if (o->p + rect_cost(h, xs, xe, ye - ys + 1) + 64 <= o->size || xs > xe || ys > ye) {
+        out_room(o, rect_cost(h, xs, xe, ye - ys + 1) + 64);
+        o->p = encode_rect(h, o->buff, o->p, pixinfo, xs, ys, xe, ye);
+        return;
+    }
+
+    enc = get_encoder(h);
+    if (enc == NULL)
+        return;
+
+    /* Same as encode_rect_tmpl(), but rows get split up */
+    if (xs < 0)
+        xs = 0;
+    if (ys < 0)
+        ys = 0;
+    if (xe >= (int)h->width)
+        xe = h->width - 1;
+    if (ye >= (int)h->height)
+        ye = h->height - 1;
+    if (h->bpp == 12) {
+        xs-=(xs&1);
+        xe+=(xe-xs+1)&1;
+    }
+
+    out_room(o, 128);
+    o->p = enc->setwin(h, o->buff, o->p, xs, xe, ys, ye);
+
+    w = xe - xs + 1;
+    if (w > 0 && xe >= (int)h->width)
+        w--;
+    rowbytes = h->width * 3;
+
+    k = (o->size - 1024) / rect_cost(h, xs, xe, 1);
+    if (k < 1)
+        k = 1;
+    for (y=ys; w>0 && y<=ye; y+=n) {
+        n = ye - y + 1 < k ? ye - y + 1 : k;
+        out_room(o, rect_cost(h, xs, xe, n));
+        o->p = enc->rows(o->buff, o->p, pixinfo + y * rowbytes + xs * 3, rowbytes, w, n);
+    }
+    o->p = enddata(o->buff, o->p);
+}
+
+int st2205_set_streaming(st2205_handle *h, int on)
+{
+#ifdef __linux__
+    struct st2205_stream *s = h->stream;
+    void *buff;
+
+    if (on && s == NULL) {
+        s = calloc(1, sizeof(*s));
+        if (s == NULL)
+            return -1;
+        s->mem = malloc_aligned(STREAM_CHUNKS * STREAM_CHUNK);
+        if (s->mem == NULL || s->mem == MAP_FAILED) {
+            free(s);
+            return -1;
+        }
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->cond, NULL);
+        h->stream = s;
+        if (pthread_create(&s->thread, NULL, stream_thread, h) != 0) {
+            h->stream = NULL;
+            pthread_cond_destroy(&s->cond);
+            pthread_mutex_destroy(&s->lock);
+            free_aligned(s->mem, STREAM_CHUNKS * STREAM_CHUNK);
+            free(s);
+            return -1;
+        }
+
+        /* Small commands use the first chunk, when nothing is queued */
+        free_aligned(h->buff, BUFF_SIZE);
+        h->buff = s->mem;
+    } else if (!on && s != NULL) {
+        buff = malloc_aligned(BUFF_SIZE);
+        if (buff == NULL || buff == MAP_FAILED)
+            return -1;
+
+        stream_stop(h);
+        h->buff = buff;
+    }
+
+    return 0;
+#else
+    return on ? -1 : 0;
+#endif
+}
+
+long st2205_estimate_cost(st2205_handle *h, const st2205_rect *rects, int n)
+{
+    long bytes;
+    int size = BUFF_SIZE;
+
+    if (n <= 0)
+        return 0;
+
+    bytes = rects_cost(h, rects, n);
+#ifdef __linux__
+    if (h->stream != NULL)
+        size = stream_chunk(h);
+#endif
+
+    return link_us(h, bytes, (bytes + size - 1) / size);
+}
+
+/*
+ Sends image (xs,ys)-(xe,ye), inclusive.
+ */
+void st2205_send_partial(st2205_handle *h, unsigned char *pixinfo, int xs, int ys, int xe, int ye)
+{
+    struct out o;
+
+    out_begin(h, &o);
+    out_rect(&o, pixinfo, xs, ys, xe, ye);
+    out_end(&o);
+    track_rect(h, pixinfo, xs, ys, xe, ye);
+}
+
+/*
+ Pre-encoded blobs. A blob is a 512 byte header, the packets for a rect,
+ padded to whole sectors, and then the r,g,b triplets of the rect, for
+ keeping track of what is on the display. The packets are written as
+ they are, so blobs are page aligned, and a blob loaded from a file is
+ mapped, not read.
+ */
+#define BLOB_MAGIC "ST2205B1"
+#define BLOB_HEADER 512
+
+struct blob_header {
+    char magic[8];
+    uint32_t size;  /* Of the whole blob */
+    uint32_t wire;  /* Bytes of packets after the header */
+    uint32_t width;
+    uint32_t height;
+    int32_t bpp;
+    int32_t proto;
+    int32_t offx;
+    int32_t offy;
+    int32_t xs, ys, xe, ye;
+    int32_t orient; /* The setwin packets are for this orientation */
+};
+
+void *st2205_encode(st2205_handle *h, unsigned char *pixinfo, int xs, int ys, int xe, int ye)
+{
+    struct blob_header *b;
+    char *tmp;
+    long wire, rgb, bound;
+    int p, y;
+
+    if (xs < 0)
+        xs = 0;
+    if (ys < 0)
+        ys = 0;
+    if (xe >= (int)h->width)
+        xe = h->width - 1;
+    if (ye >= (int)h->height)
+        ye = h->height - 1;
+    if (xs > xe || ys > ye)
+        return NULL;
+
+    /* The size has to be known before the blob is allocated */
+    bound = rect_cost(h, xs, xe, ye - ys + 1) + 512;
+    tmp = malloc(bound);
+    if (tmp == NULL)
+        return NULL;
+    p = encode_rect(h, tmp, 0, pixinfo, xs, ys, xe, ye);
+    for (; p%512; p++)
+        tmp[p] = 0;
+    wire = p;
+    rgb = (long)(xe - xs + 1) * (ye - ys + 1) * 3;
+
+    b = malloc_aligned(BLOB_HEADER + wire + rgb);
+#ifndef _WIN32
+    if (b == MAP_FAILED)
+        b = NULL;
+#endif
+    if (b == NULL) {
+        free(tmp);
+        return NULL;
+    }
+    memset(b, 0, BLOB_HEADER);
+    memcpy(b->magic, BLOB_MAGIC, sizeof(b->magic));
+    b->size = BLOB_HEADER + wire + rgb;
+    b->wire = wire;
+    b->width = h->width;
+    b->height = h->height;
+    b->bpp = h->bpp;
+    b->proto = h->proto;
+    b->offx = h->offx;
+    b->offy = h->offy;
+    b->xs = xs;
+    b->ys = ys;
+    b->xe = xe;
+    b->ye = ye;
+    b->orient = h->orient;
+
+    memcpy((char *)b + BLOB_HEADER, tmp, wire);
+    free(tmp);
+    for (y=ys; y<=ye; y++) {
+        memcpy((char *)b + BLOB_HEADER + wire + (long)(y - ys) * (xe - xs + 1) * 3,
+               pixinfo + (y * h->width + xs) * 3, (xe - xs + 1) * 3);
+    }
+
+    return b;
+}
+
+long st2205_blob_size(const void *blob)
+{
+    return ((const struct blob_header *)blob)->size;
+}
+
+int st2205_send_blob(st2205_handle *h, const void *blob)
+{
+    const struct blob_header *b = blob;
+    const unsigned char *rgb;
+    int w, y;
+
+    if (b->width != h->width || b->height != h->height || b->bpp != h->bpp ||
+        b->proto != h->proto || b->offx != h->offx || b->offy != h->offy ||
+        b->orient != h->orient)
+        return -1;
+
+    /* Already padded, so write_stream() doesn't write to it */
+    if (write_stream(h, (char *)b + BLOB_HEADER, b->wire) != (int)b->wire)
+        return -1;
+
+    /* A whole frame starts the previous frame, like in st2205_send_data() */
+    if (h->damage_mode == ST2205_DAMAGE_EXACT && h->oldpix == NULL &&
+        b->xs == 0 && b->ys == 0 && b->xe == (int)h->width - 1 && b->ye == (int)h->height - 1)
+        h->oldpix = shadow_alloc(h);
+
+    if (h->damage_mode == ST2205_DAMAGE_EXACT && h->oldpix != NULL) {
+        rgb = (const unsigned char *)b + BLOB_HEADER + b->wire;
+        w = b->xe - b->xs + 1;
+        for (y=b->ys; y<=b->ye; y++) {
+            memcpy(h->oldpix + (y * h->width + b->xs) * 3,
+                   rgb + (long)(y - b->ys) * w * 3, w * 3);
+        }
+    } else {
+        track_rect(h, NULL, b->xs, b->ys, b->xe, b->ye);
+    }
+
+    return 0;
+}
+
+int st2205_save_blob(const void *blob, const char *path)
+{
+    FILE *f;
+    long size = st2205_blob_size(blob);
+    int ok;
+
+    f = fopen(path, "wb");
+    if (f == NULL)
+        return -1;
+    ok = fwrite(blob, 1, size, f) == (size_t)size;
+    if (fclose(f) != 0)
+        ok = 0;
+
+    return ok ? 0 : -1;
+}
+
+/*
+ Checks that a blob of size bytes holds what its header says.
+ */
+static int blob_valid(const struct blob_header *b, long size)
+{
+    long rgb;
+
+    if (size < BLOB_HEADER || memcmp(b->magic, BLOB_MAGIC, sizeof(b->magic)) != 0 ||
+        b->size != size || b->wire % 512 != 0 ||
+        b->xs < 0 || b->ys < 0 || b->xs > b->xe || b->ys > b->ye ||
+        b->xe >= (int32_t)b->width || b->ye >= (int32_t)b->height)
+        return 0;
+
+    rgb = (long)(b->xe - b->xs + 1) * (b->ye - b->ys + 1) * 3;
+    return BLOB_HEADER + (long)b->wire + rgb == size;
+}
+
+void *st2205_load_blob(const char *path)
+{
+    struct stat st;
+    void *blob;
+    int fd;
+
+    fd = open(path, O_RDONLY
+#ifdef _WIN32
+                    | O_BINARY
+#endif
+             );
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size < BLOB_HEADER) {
+        close(fd);
+        return NULL;
+    }
+
+#ifdef _WIN32
+    blob = malloc_aligned(st.st_size);
+    if (blob != NULL && read(fd, blob, st.st_size) != st.st_size) {
+        free_aligned(blob, st.st_size);
+        blob = NULL;
+    }
+#else
+    blob = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (blob == MAP_FAILED)
+        blob = NULL;
+#endif
+    close(fd);
+
+    if (blob != NULL && !blob_valid(blob, st.st_size)) {
+        free_aligned(blob, st.st_size);
+        blob = NULL;
+    }
+
+    return blob;
+}
+
+void st2205_free_blob(void *blob)
+{
+    if (blob != NULL)
+        free_aligned(blob, st2205_blob_size(blob));
+}
+
+/*
+ Encodes all the rects into one stream and sends it with one write. Only if
+ they don't all fit in the buffer, the stream is split into more writes.
+ */
+static void write_rects(st2205_handle *h, unsigned char *pixinfo, const st2205_rect *rects, int n)
+{
+    struct out o;
+    st2205_rect r;
+    int i;
+
+    out_begin(h, &o);
+    for (i=0; i<n; i++) {
+        r = rects[i];
+        if (r.xs < 0)
+            r.xs = 0;
+        if (r.ys < 0)
+            r.ys = 0;
+        if (r.xe >= (int)h->width)
+            r.xe = h->width - 1;
+        if (r.ye >= (int)h->height)
+            r.ye = h->height - 1;
+        if (r.xs > r.xe || r.ys > r.ye)
+            continue;
+
+        out_rect(&o, pixinfo, r.xs, r.ys, r.xe, r.ye);
+    }
+    out_end(&o);
+}
+
+void st2205_send_rects(st2205_handle *h, unsigned char *pixinfo, const st2205_rect *rects, int n)
+{
+    int i;
+
+    write_rects(h, pixinfo, rects, n);
+
+    for (i=0; i<n; i++)
+        track_rect(h, pixinfo, rects[i].xs, rects[i].ys, rects[i].xe, rects[i].ye);
+}
+
+/*
+ Progressive mode. A frame which costs more than h->progressive bytes to
+ send is kept in prog, and sent a quarter of the rows at a time, as one
+ window per row. Rows 0, 4, 8... of the damage go first, then the rows
+ between those, so a big change shows up all over the screen at once.
+ Only rows sent are tracked, so a cancelled frame still leaves oldpix
+ matching the display. write_stream() cancels by clearing progpass.
+ */
+#define PROG_PASSES 4
+
+struct st2205_progress {
+    unsigned char *pix;
+    st2205_rect rects[ST2205_MAX_RECTS];
+    st2205_rect *rows;
+    int n;
+};
+
+static const int prog_order[PROG_PASSES] = { 0, 2, 1, 3 };
+
+static void send_pass(st2205_handle *h, int pass)
+{
+    struct st2205_progress *pr = h->prog;
+    unsigned int nt;
+    int i, y, n;
+
+    n = 0;
+    for (i=0; i<pr->n; i++) {
+        for (y=pr->rects[i].ys; y<=pr->rects[i].ye; y++) {
+            if ((y & (PROG_PASSES - 1)) != prog_order[pass])
+                continue;
+            pr->rows[n] = pr->rects[i];
+            pr->rows[n].ys = y;
+            pr->rows[n].ye = y;
+            n++;
+        }
+    }
+
+    write_rects(h, pr->pix, pr->rows, n);
+    for (i=0; i<n; i++)
+        track_rect(h, pr->pix, pr->rows[i].xs, pr->rows[i].ys, pr->rows[i].xe, pr->rows[i].ye);
+
+    if (pass + 1 < PROG_PASSES) {
+        h->progpass = pass + 1;
+        return;
+    }
+
+    /* Done, so the reference can be set up like track_frame() does */
+    h->progpass = 0;
+    if (h->damage_mode == ST2205_DAMAGE_TILES) {
+        nt = tiles_x(h) * tiles_y(h);
+        if (h->tilehash == NULL)
+            h->tilehash = malloc(sizeof(uint64_t) * nt * 2);
+        if (h->tilehash != NULL)
+            h->framehash = hash_tiles(h, pr->pix, h->tilehash);
+    } else if (h->oldpix == NULL) {
+        h->oldpix = shadow_alloc(h);
+        if (h->oldpix != NULL)
+            memcpy(h->oldpix, pr->pix, h->width * h->height * 3);
+    }
+}
+
+static int send_progressive(st2205_handle *h, const unsigned char *pixinfo,
+                            const st2205_rect *rects, int n)
+{
+    struct st2205_progress *pr = h->prog;
+
+    if (pr == NULL) {
+        pr = calloc(1, sizeof(*pr));
+        if (pr == NULL)
+            return -1;
+        pr->pix = malloc(h->width * h->height * 3);
+        pr->rows = malloc(sizeof(st2205_rect) * h->height);
+        if (pr->pix == NULL || pr->rows == NULL) {
+            free(pr->pix);
+            free(pr->rows);
+            free(pr);
+            return -1;
+        }
+        h->prog = pr;
+    }
+
+    memcpy(pr->pix, pixinfo, h->width * h->height * 3);
+    memcpy(pr->rects, rects, sizeof(st2205_rect) * n);
+    pr->n = n;
+    send_pass(h, 0);
+
+    return 0;
+}
+
+void st2205_set_progressive(st2205_handle *h, int bytes)
+{
+    h->progressive = bytes;
+}
+
+int st2205_refine(st2205_handle *h)
+{
+    if (h->progpass == 0)
+        return 0;
+
+    send_pass(h, h->progpass);
+
+    return h->progpass ? PROG_PASSES - h->progpass : 0;
+}
+
+/*
+ Pixinfo is a char array containing r,g,b triplets.
+ */
+void st2205_send_data(st2205_handle *h, unsigned char *pixinfo)
+{
+    st2205_rect rects[ST2205_MAX_RECTS];
+    int n;
+
+    /*
+     PCF8833 has the possibility to do partial transfers into a certain bounding
+     box. Optimize for that by only sending windows around the changes.
+     All of them go out in one write.
+     */
+    n = 0;
+    if (h->proto == PROTO_PCF8833 || h->proto == PROTO_MERCURY) {
+        n = st2205_find_damage(h, pixinfo, rects, ST2205_MAX_RECTS);
+
+        /* Big changes go out a pass at a time, if asked to */
+        if (n > 0 && h->progressive > 0 && rects_cost(h, rects, n) > h->progressive &&
+            send_progressive(h, pixinfo, rects, n) == 0)
+            return;
+
+        /* Sometimes there is no change. */
+        if (n > 0)
+            write_rects(h, pixinfo, rects, n);
+    } else {
+        fprintf(stderr, "libst2205: Unrecognized protocol: 0x%x!\n", h->proto);
+    }
+
+    track_frame(h, pixinfo, rects, n);
+}
+
+/*
+ With a previous frame in oldpix, the RGBA data is converted straight into
+ oldpix, noting which pixels changed, and the changes are sent from there.
+ This reads the RGBA data once and writes only changed parts of oldpix.
+ */
+void st2205_rgba(st2205_handle *h, const unsigned char *data)
+{
+    st2205_rect rects[ST2205_MAX_RECTS];
+    int *first, *last, n, e;
+    unsigned int y;
+
+    /*
+     Tile hashes can't be updated in place like oldpix, and in lossy and
+     progressive mode oldpix has to keep what was not sent.
+     */
+    if (h->damage_mode == ST2205_DAMAGE_TILES || h->lossy || h->lossy_budget ||
+        h->progressive) {
+        if (h->rgbabuf == NULL) {
+            h->rgbabuf = malloc(h->width * h->height * 3);
+            if (h->rgbabuf == NULL) return;
+        }
+
+        for (y = 0; y < h->height; y++) {
+            rgba_row(data + y * h->width * 4, h->rgbabuf + y * h->width * 3,
+                     h->width, &e);
+        }
+        st2205_send_data(h, h->rgbabuf);
+        return;
+    }
+
+    if (h->oldpix == NULL) {
+        h->oldpix = shadow_alloc(h);
+        if (h->oldpix == NULL) return;
+
+        for (y = 0; y < h->height; y++) {
+            rgba_row(data + y * h->width * 4, h->oldpix + y * h->width * 3,
+                     h->width, &e);
+        }
+        st2205_send_partial(h, h->oldpix, 0, 0, h->width - 1, h->height - 1);
+        return;
+    }
+
+    first = malloc(sizeof(int) * h->height * 2);
+    if (first == NULL) return;
+    last = first + h->height;
+
+    n = 0;
+    for (y = 0; y < h->height; y++) {
+        first[y] = rgba_row(data + y * h->width * 4, h->oldpix + y * h->width * 3,
+                            h->width, &last[y]);
+        if (first[y] >= 0)
+            n++;
+    }
+
+    if (n > 0) {
+        n = plan_rects(h, first, last, rects, ST2205_MAX_RECTS);
+        write_rects(h, h->oldpix, rects, n);
+    }
+
+    free(first);
+}
+
+/*
+ Converts into oldpix if there is a previous frame there, so it stays
+ up to date. Otherwise, there is no point in keeping the rest of the
+ frame, and rgbabuf is used.
+ */
+void st2205_rgba_partial(st2205_handle *h, const unsigned char *data,
+                         int xs, int ys, int xe, int ye)
+{
+    int x, rows, y, cols, pixidx, pixskip, srcskip, destskip;
+    const unsigned char *src;
+    unsigned char *dest, *buf;
+
+    if (h->oldpix != NULL) {
+        buf = h->oldpix;
+    } else {
+        if (h->rgbabuf == NULL) {
+            h->rgbabuf = malloc(h->width * h->height * 3);
+            if (h->rgbabuf == NULL) return;
+        }
+        buf = h->rgbabuf;
+    }
+
+    cols = xe - xs + 1;
+    rows = ye - ys + 1;
+
+    pixidx = h->width * ys + xs;
+    pixskip = h->width - cols;
+    src = &data[pixidx * 4];
+    srcskip = pixskip * 4;
+    dest = &(buf[pixidx * 3]);
+    destskip = pixskip * 3;
+
+    for (y = rows; y != 0; y--) {
+        for (x = cols; x != 0; x--) {
+            dest[0] = src[2];
+            dest[1] = src[1];
+            dest[2] = src[0];
+            dest += 3;
+            src += 4;
+        }
+        src += srcskip;
+        dest += destskip;
+    }
+
+    st2205_send_partial(h, buf, xs, ys, xe, ye);
+}
+
+/*
+ Converts n pixels of the given format to r,g,b triplets.
+ */
+static void convert_row(int format, const unsigned char *src, unsigned char *dst, int n)
+{
+    uint32_t v;
+    uint16_t w;
+    int i;
+
+    switch (format) {
+    case ST2205_FMT_RGB24:
+        memcpy(dst, src, n * 3);
+        break;
+
+    case ST2205_FMT_BGR24:
+        for (i=0; i<n; i++, src+=3, dst+=3) {
+            dst[0] = src[2];
+            dst[1] = src[1];
+            dst[2] = src[0];
+        }
+        break;
+
+    case ST2205_FMT_RGBA:
+        for (i=0; i<n; i++, src+=4, dst+=3) {
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst[2] = src[2];
+        }
+        break;
+
+    case ST2205_FMT_BGRA:
+        for (i=0; i<n; i++, src+=4, dst+=3) {
+            dst[0] = src[2];
+            dst[1] = src[1];
+            dst[2] = src[0];
+        }
+        break;
+
+    case ST2205_FMT_XRGB8888:
+    case ST2205_FMT_GD:
+        /* gd keeps alpha in the top 7 bits, which are ignored anyway */
+        for (i=0; i<n; i++, src+=4, dst+=3) {
+            memcpy(&v, src, 4);
+            dst[0] = v >> 16;
+            dst[1] = v >> 8;
+            dst[2] = v;
+        }
+        break;
+
+    case ST2205_FMT_RGB565:
+        /* Top bits are repeated at the bottom, so white stays white */
+        for (i=0; i<n; i++, src+=2, dst+=3) {
+            memcpy(&w, src, 2);
+            dst[0] = ((w >> 8) & 0xf8) | (w >> 13);
+            dst[1] = ((w >> 3) & 0xfc) | ((w >> 9) & 0x03);
+            dst[2] = ((w << 3) & 0xf8) | ((w >> 2) & 0x07);
+        }
+        break;
+    }
+}
+
+static int format_bytes(int format)
+{
+    switch (format) {
+    case ST2205_FMT_RGB24:
+    case ST2205_FMT_BGR24:
+        return 3;
+    case ST2205_FMT_RGB565:
+        return 2;
+    case ST2205_FMT_RGBA:
+    case ST2205_FMT_BGRA:
+    case ST2205_FMT_XRGB8888:
+    case ST2205_FMT_GD:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+/*
+ Each row is converted into a small buffer and encoded from there, so the
+ image never needs to be in a full frame buffer. If there is a previous
+ frame in oldpix, rows are also copied there, keeping it up to date.
+ */
+int st2205_blit(st2205_handle *h, const void *src, int stride, int format,
+                int dstx, int dsty, int width, int height)
+{
+    const struct st2205_encoder *enc;
+    const unsigned char *s = src;
+    unsigned char *row, *old;
+    struct out o;
+    int bytes, y, xs, xe, wxs, wxe, n;
+
+    bytes = format_bytes(format);
+    enc = get_encoder(h);
+    if (bytes == 0 || enc == NULL)
+        return -1;
+
+    /* Clip to the screen */
+    if (dstx < 0) {
+        s -= dstx * bytes;
+        width += dstx;
+        dstx = 0;
+    }
+    if (dsty < 0) {
+        s -= dsty * stride;
+        height += dsty;
+        dsty = 0;
+    }
+    if (dstx + width > (int)h->width)
+        width = h->width - dstx;
+    if (dsty + height > (int)h->height)
+        height = h->height - dsty;
+    if (width <= 0 || height <= 0)
+        return 0;
+
+    xs = dstx;
+    xe = dstx + width - 1;
+
+    /*
+     bpp=12 needs an even start and width. Any extra pixels come from oldpix
+     if it's there. Otherwise the edge pixels are repeated.
+     */
+    wxs = xs;
+    wxe = xe;
+    if (h->bpp == 12) {
+        wxs -= (wxs&1);
+        wxe += (wxe-wxs+1)&1;
+    }
+    n = wxe - wxs + 1;
+
+    row = malloc(n * 3);
+    if (row == NULL)
+        return -1;
+
+    old = (h->damage_mode == ST2205_DAMAGE_EXACT) ? h->oldpix : NULL;
+
+    out_begin(h, &o);
+    o.p = enc->setwin(h, o.buff, 0, wxs, wxe, dsty, dsty + height - 1);
+    for (y=dsty; y<dsty+height; y++, s+=stride) {
+        convert_row(format, s, row + (xs - wxs) * 3, width);
+
+        if (wxs < xs) {
+            memcpy(row, old ? old + (y * h->width + wxs) * 3 : row + 3, 3);
+        }
+        if (wxe > xe) {
+            if (wxe >= (int)h->width)
+                memset(row + (n - 1) * 3, 0, 3);
+            else
+                memcpy(row + (n - 1) * 3, old ? old + (y * h->width + wxe) * 3
+                                              : row + (n - 2) * 3, 3);
+        }
+
+        if (old != NULL) {
+            memcpy(old + (y * h->width + wxs) * 3, row,
+                   (wxe < (int)h->width ? n : n - 1) * 3);
+        }
+
+        out_room(&o, rect_cost(h, wxs, wxe, 1));
+        o.p = enc->rows(o.buff, o.p, row, n * 3, wxe < (int)h->width ? n : n - 1, 1);
+    }
+    o.p = enddata(o.buff, o.p);
+    out_end(&o);
+
+    if (old == NULL)
+        track_rect(h, NULL, wxs, dsty, wxe, dsty + height - 1);
+
+    free(row);
+    return 0;
+}
+
+/*
+ Region queue. Every region has its own copy of the pixels, already
+ widened for bpp=12, and is sent in chunks of whole rows, each starting
+ with its own window, so something more urgent can go between chunks.
+ A region queued over part of an older one also updates that one's
+ pixels, so the newest pixels win whatever order they go out in.
+ */
+struct st2205_region {
+    struct st2205_region *next;
+    unsigned char *pix;
+    int xs, ys, xe, ye;
+    int row;
+    int priority;
+    int64_t deadline;
+    unsigned int seq;
+};
+
+struct st2205_queue {
+    struct st2205_region *head;
+    unsigned int seq;
+};
+
+/*
+ Higher priority first, then earliest deadline, then oldest.
+ */
+static int region_before(const struct st2205_region *a, const struct st2205_region *b)
+{
+    if (a->priority != b->priority)
+        return a->priority > b->priority;
+    if (a->deadline != b->deadline)
+        return a->deadline < b->deadline;
+    return (int)(a->seq - b->seq) < 0;
+}
+
+static void free_region(struct st2205_region *r)
+{
+    free(r->pix);
+    free(r);
+}
+
+int st2205_queue_rect(st2205_handle *h, const unsigned char *pixinfo, int xs, int ys, int xe, int ye,
+                      int priority, int deadline_ms)
+{
+    struct st2205_queue *q = h->queue;
+    struct st2205_region *r, *o, **link;
+    int w, y, oxs, oxe, oys, oye;
+
+    if (xs < 0)
+        xs = 0;
+    if (ys < 0)
+        ys = 0;
+    if (xe >= (int)h->width)
+        xe = h->width - 1;
+    if (ye >= (int)h->height)
+        ye = h->height - 1;
+    if (h->bpp == 12) {
+        xs -= (xs&1);
+        if (((xe - xs + 1) & 1) && xe + 1 < (int)h->width)
+            xe++;
+    }
+    if (xs > xe || ys > ye)
+        return 0;
+
+    if (q == NULL) {
+        q = calloc(1, sizeof(*q));
+        if (q == NULL)
+            return -1;
+        h->queue = q;
+    }
+
+    r = malloc(sizeof(*r));
+    if (r == NULL)
+        return -1;
+    w = xe - xs + 1;
+    r->pix = malloc(w * (ye - ys + 1) * 3);
+    if (r->pix == NULL) {
+        free(r);
+        return -1;
+    }
+    for (y=ys; y<=ye; y++)
+        memcpy(r->pix + (y - ys) * w * 3, pixinfo + (y * h->width + xs) * 3, w * 3);
+    r->xs = xs;
+    r->ys = ys;
+    r->xe = xe;
+    r->ye = ye;
+    r->row = ys;
+    r->priority = priority;
+    r->deadline = deadline_ms > 0 ? now_us() + (int64_t)deadline_ms * 1000 : INT64_MAX;
+    r->seq = q->seq++;
+
+    /* Drop regions this one covers, and update ones it overlaps */
+    for (link = &q->head; (o = *link) != NULL; ) {
+        if (xs <= o->xs && xe >= o->xe && ys <= o->row && ye >= o->ye) {
+            *link = o->next;
+            free_region(o);
+            continue;
+        }
+        oxs = xs > o->xs ? xs : o->xs;
+        oxe = xe < o->xe ? xe : o->xe;
+        oys = ys > o->row ? ys : o->row;
+        oye = ye < o->ye ? ye : o->ye;
+        for (y=oys; oxs<=oxe && y<=oye; y++) {
+            memcpy(o->pix + ((y - o->ys) * (o->xe - o->xs + 1) + oxs - o->xs) * 3,
+                   r->pix + ((y - ys) * w + oxs - xs) * 3, (oxe - oxs + 1) * 3);
+        }
+        link = &o->next;
+    }
+
+    r->next = q->head;
+    q->head = r;
+    return 0;
+}
+
+int st2205_step(st2205_handle *h, int max_bytes)
+{
+    struct st2205_queue *q = h->queue;
+    const struct st2205_encoder *enc;
+    struct st2205_region *r, *q2, **link, **best;
+    struct out o;
+    int w, rows, y, n;
+
+    if (q == NULL || q->head == NULL)
+        return 0;
+
+    enc = get_encoder(h);
+    if (enc == NULL)
+        return -1;
+
+    if (max_bytes <= 0)
+        max_bytes = link_bytes(h, ST2205_CHUNK_US);
+    out_begin(h, &o);
+    if (max_bytes > o.size - 512)
+        max_bytes = o.size - 512;
+
+    best = &q->head;
+    for (link = &q->head; *link != NULL; link = &(*link)->next) {
+        if (region_before(*link, *best))
+            best = link;
+    }
+    r = *best;
+
+    /* As many whole rows as fit, but at least one */
+    w = r->xe - r->xs + 1;
+    for (rows = 1; r->row + rows <= r->ye &&
+                   rect_cost(h, r->xs, r->xe, rows + 1) <= max_bytes; rows++);
+
+    o.p = enc->setwin(h, o.buff, 0, r->xs, r->xe, r->row, r->row + rows - 1);
+    o.p = enc->rows(o.buff, o.p, r->pix + (r->row - r->ys) * w * 3, w * 3, w, rows);
+    o.p = enddata(o.buff, o.p);
+    out_end(&o);
+
+    if (h->damage_mode == ST2205_DAMAGE_EXACT && h->oldpix != NULL) {
+        for (y=r->row; y<r->row+rows; y++) {
+            memcpy(h->oldpix + (y * h->width + r->xs) * 3,
+                   r->pix + (y - r->ys) * w * 3, w * 3);
+        }
+    } else {
+        track_rect(h, NULL, r->xs, r->row, r->xe, r->row + rows - 1);
+    }
+
+    r->row += rows;
+    if (r->row > r->ye) {
+        *best = r->next;
+        free_region(r);
+    }
+
+    n = 0;
+    for (q2 = q->head; q2 != NULL; q2 = q2->next)
+        n++;
+    return n;
+}
+
+/*
+ Planar YUV input. The last frame's planes are kept in yuvpix, so
+ changes are found by comparing 1.5 bytes per pixel instead of 3, and only
+ changed spans are converted, straight into oldpix. The rest of oldpix
+ already holds the converted previous frame, so it is sent from there.
+ yuvkey says what is in yuvpix, and is cleared by write_stream(), because
+ anything else sent makes yuvpix stale.
+ */
+struct yuv_frame {
+    const unsigned char *y, *u, *v;
+    int ystride, uvstride, uvstep;
+};
+
+static inline void span_union(int *s, int *e, int s2, int e2)
+{
+    if (s2 < 0)
+        return;
+    if (*s < 0 || s2 < *s)
+        *s = s2;
+    if (e2 > *e)
+        *e = e2;
+}
+
+/*
+ Both rows of a pair share chroma, so they get the same span, covering
+ whole chroma samples. Then yuvpix always holds exactly what oldpix came
+ from.
+ */
+static int diff_yuv(st2205_handle *h, const void *arg, int t, int *first, int *last)
+{
+    const struct yuv_frame *f = arg;
+    int w = h->width, cw = (h->width + 1) / 2, ch = (h->height + 1) / 2;
+    unsigned char *sy = h->yuvpix, *su = sy + w * h->height, *sv = su + cw * ch;
+    int c, y, s, e, s2, e2, changed = 0;
+
+    for (c = 0; c < ch; c++) {
+        e = -1;
+        if (f->uvstep == 2) {
+            s = change_span(f->u + c * f->uvstride, su + c * cw * 2, cw * 2, t, &e);
+            e >>= 1;
+        } else {
+            s = change_span(f->u + c * f->uvstride, su + c * cw, cw, t, &e);
+            s2 = change_span(f->v + c * f->uvstride, sv + c * cw, cw, t, &e2);
+            span_union(&s, &e, s2, e2);
+        }
+        if (s >= 0) {
+            s = s / f->uvstep * 2;
+            e = e * 2 + 1;
+        }
+
+        for (y = c * 2; y < c * 2 + 2 && y < (int)h->height; y++) {
+            s2 = change_span(f->y + y * f->ystride, sy + y * w, w, t, &e2);
+            span_union(&s, &e, s2, e2);
+        }
+
+        /* Whole chroma samples */
+        if (s >= 0) {
+            s &= ~1;
+            e |= 1;
+            if (e >= w)
+                e = w - 1;
+        }
+        for (y = c * 2; y < c * 2 + 2 && y < (int)h->height; y++) {
+            first[y] = s;
+            last[y] = e;
+            if (s >= 0)
+                changed++;
+        }
+    }
+
+    return changed;
+}
+
+static void send_yuv(st2205_handle *h, const struct yuv_frame *f, int nv12, int colorspace)
+{
+    st2205_rect rects[ST2205_MAX_RECTS];
+    const short *k = yuv_coef[colorspace == ST2205_YUV_BT709];
+    int w = h->width, cw = (h->width + 1) / 2, ch = (h->height + 1) / 2;
+    int key = 1 + nv12 * 2 + (colorspace == ST2205_YUV_BT709);
+    const unsigned char *yr, *ur, *vr;
+    unsigned char *sy, *su, *sv;
+    int *first, *last, n, c, y, s, e;
+
+    /* Tile hashes need the whole RGB frame anyway */
+    if (h->damage_mode == ST2205_DAMAGE_TILES) {
+        if (h->rgbabuf == NULL) {
+            h->rgbabuf = malloc(h->width * h->height * 3);
+            if (h->rgbabuf == NULL) return;
+        }
+
+        for (y = 0; y < (int)h->height; y++) {
+            yuv_row(f->y + y * f->ystride, f->u + y/2 * f->uvstride, f->v + y/2 * f->uvstride,
+                    f->uvstep, h->rgbabuf + y * w * 3, w, k);
+        }
+        st2205_send_data(h, h->rgbabuf);
+        return;
+    }
+
+    if (h->yuvpix == NULL) {
+        h->yuvpix = malloc(w * h->height + 2 * cw * ch);
+        if (h->yuvpix == NULL) return;
+        h->yuvkey = 0;
+    }
+    if (h->oldpix == NULL) {
+        h->oldpix = shadow_alloc(h);
+        if (h->oldpix == NULL) return;
+        h->yuvkey = 0;
+    }
+    first = malloc(sizeof(int) * h->height * 2);
+    if (first == NULL) return;
+    last = first + h->height;
+
+    if (h->yuvkey != key) {
+        for (y = 0; y < (int)h->height; y++) {
+            first[y] = 0;
+            last[y] = w - 1;
+        }
+        rects[0].xs = 0;
+        rects[0].ys = 0;
+        rects[0].xe = w - 1;
+        rects[0].ye = h->height - 1;
+        n = 1;
+    } else {
+        n = plan_lossy(h, diff_yuv, f, first, last, rects, ST2205_MAX_RECTS);
+    }
+
+    /* Only what gets sent is converted and noted in yuvpix */
+    sy = h->yuvpix;
+    su = sy + w * h->height;
+    sv = su + cw * ch;
+    for (c = 0; c < ch; c++) {
+        s = first[c * 2];
+        e = last[c * 2];
+        if (s < 0)
+            continue;
+
+        ur = f->u + c * f->uvstride;
+        vr = f->v + c * f->uvstride;
+        for (y = c * 2; y < c * 2 + 2 && y < (int)h->height; y++) {
+            yr = f->y + y * f->ystride;
+            yuv_row(yr + s, ur + s/2 * f->uvstep, vr + s/2 * f->uvstep, f->uvstep,
+                    h->oldpix + (y * w + s) * 3, e - s + 1, k);
+            memcpy(sy + y * w + s, yr + s, e - s + 1);
+        }
+        if (nv12) {
+            memcpy(su + c * cw * 2 + s, ur + s, (e/2 - s/2 + 1) * 2);
+        } else {
+            memcpy(su + c * cw + s/2, ur + s/2, e/2 - s/2 + 1);
+            memcpy(sv + c * cw + s/2, vr + s/2, e/2 - s/2 + 1);
+        }
+    }
+
+    if (n > 0)
+        write_rects(h, h->oldpix, rects, n);
+    h->yuvkey = key;
+
+    free(first);
+}
+
+void st2205_i420(st2205_handle *h, const unsigned char *y, int ystride,
+                 const unsigned char *u, const unsigned char *v, int uvstride,
+                 int colorspace)
+{
+    struct yuv_frame f = { y, u, v, ystride, uvstride, 1 };
+
+    send_yuv(h, &f, 0, colorspace);
+}
+
+void st2205_nv12(st2205_handle *h, const unsigned char *y, int ystride,
+                 const unsigned char *uv, int uvstride, int colorspace)
+{
+    struct yuv_frame f = { y, uv, uv + 1, ystride, uvstride, 2 };
+
+    send_yuv(h, &f, 1, colorspace);
+}
+
+/*
+ Library owned framebuffer. Its pages are kept read-only between flushes,
+ and the first write to a page faults into fb_fault(), which notes the page
+ and makes it writable. A flush then only looks at rows on those pages,
+ like fbdev deferred I/O does.
+ */
+#ifndef _WIN32
+#define FB_MAX_HANDLES 8
+
+static st2205_handle *volatile fb_handles[FB_MAX_HANDLES];
+static struct sigaction fb_oldsa;
+static int fb_installed;
+static long fb_pagesize;
+
+static void fb_fault(int sig, siginfo_t *si, void *ctx)
+{
+    struct sigaction sa;
+    st2205_handle *h;
+    char *a = si->si_addr;
+    long page;
+    int i;
+
+    for (i=0; i<FB_MAX_HANDLES; i++) {
+        h = fb_handles[i];
+        if (h != NULL && a >= (char *)h->fb && a < (char *)h->fb + h->fbsize) {
+            page = (a - (char *)h->fb) / fb_pagesize;
+            h->fbdirty[page] = 1;
+            h->fbtouched = 1;
+            mprotect(h->fb + page * fb_pagesize, fb_pagesize, PROT_READ | PROT_WRITE);
+            return;
+        }
+    }
+
+    /* Not ours, so do what would have happened without this handler */
+    if (fb_oldsa.sa_flags & SA_SIGINFO) {
+        fb_oldsa.sa_sigaction(sig, si, ctx);
+    } else if (fb_oldsa.sa_handler != SIG_DFL && fb_oldsa.sa_handler != SIG_IGN) {
+        fb_oldsa.sa_handler(sig);
+    } else {
+        /* Faults again on return, and then it is fatal */
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = SIG_DFL;
+        sigaction(sig, &sa, NULL);
+    }
+}
+
+static int fb_register(st2205_handle *h)
+{
+    struct sigaction sa;
+    int i;
+
+    if (!fb_installed) {
+        fb_pagesize = sysconf(_SC_PAGESIZE);
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = fb_fault;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGSEGV, &sa, &fb_oldsa) < 0)
+            return -1;
+        fb_installed = 1;
+    }
+
+    for (i=0; i<FB_MAX_HANDLES; i++) {
+        if (fb_handles[i] == NULL) {
+            fb_handles[i] = h;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static void fb_unregister(st2205_handle *h)
+{
+    int i;
+
+    for (i=0; i<FB_MAX_HANDLES; i++) {
+        if (fb_handles[i] == h)
+            fb_handles[i] = NULL;
+    }
+}
+#endif /* !_WIN32 */
+
+unsigned char *st2205_fb_alloc(st2205_handle *h)
+{
+    long size = h->width * h->height * 3;
+
+    if (h->fb != NULL)
+        return h->fb;
+
+#ifndef _WIN32
+    if (fb_register(h) == 0) {
+        size = (size + fb_pagesize - 1) / fb_pagesize * fb_pagesize;
+        h->fbdirty = malloc(size / fb_pagesize);
+        h->fb = malloc_aligned(size);
+        if (h->fb == MAP_FAILED)
+            h->fb = NULL;
+        if (h->fb == NULL || h->fbdirty == NULL) {
+            fb_unregister(h);
+            free_aligned(h->fb, size);
+            free(h->fbdirty);
+            h->fb = NULL;
+            h->fbdirty = NULL;
+            return NULL;
+        }
+
+        /* Writable, and all dirty, until the first flush */
+        memset(h->fbdirty, 1, size / fb_pagesize);
+        h->fbsize = size;
+        h->fbtouched = 1;
+        return h->fb;
+    }
+#endif
+
+    /* Without write tracking, flushing finds changes by comparing */
+    h->fb = malloc_aligned(size);
+#ifndef _WIN32
+    if (h->fb == MAP_FAILED)
+        h->fb = NULL;
+#endif
+    if (h->fb != NULL)
+        h->fbsize = size;
+    return h->fb;
+}
+
+void st2205_fb_flush(st2205_handle *h)
+{
+#ifndef _WIN32
+    st2205_rect rects[ST2205_MAX_RECTS];
+    int *first, *last, rowbytes, changed, n, y, ye;
+    long page, pages, run;
+#endif
+
+    if (h->fb == NULL)
+        return;
+
+    if (h->fbdirty == NULL) {
+        st2205_send_data(h, h->fb);
+        return;
+    }
+
+#ifndef _WIN32
+    /* Nothing was written */
+    if (!h->fbtouched && have_reference(h))
+        return;
+
+    first = malloc(sizeof(int) * h->height * 2);
+    if (first == NULL) return;
+    last = first + h->height;
+
+    for (y = 0; y < (int)h->height; y++)
+        first[y] = -1;
+
+    /*
+     Protect the pages before reading them, so writes from now on are
+     seen by the next flush.
+     */
+    h->fbtouched = 0;
+    rowbytes = h->width * 3;
+    pages = h->fbsize / fb_pagesize;
+    for (page = 0; page < pages; page += run) {
+        for (run = 0; page + run < pages && h->fbdirty[page + run]; run++)
+            h->fbdirty[page + run] = 0;
+        if (run == 0) {
+            run = 1;
+            continue;
+        }
+        mprotect(h->fb + page * fb_pagesize, run * fb_pagesize, PROT_READ);
+
+        ye = ((page + run) * fb_pagesize - 1) / rowbytes;
+        for (y = page * fb_pagesize / rowbytes; y <= ye && y < (int)h->height; y++) {
+            first[y] = 0;
+            last[y] = h->width - 1;
+        }
+    }
+
+    if (!have_reference(h)) {
+        st2205_send_data(h, h->fb);
+        free(first);
+        return;
+    }
+
+    /* Written pages may still hold the same pixels */
+    changed = 0;
+    for (y = 0; y < (int)h->height; y++) {
+        if (first[y] < 0)
+            continue;
+        if (h->damage_mode == ST2205_DAMAGE_EXACT) {
+            first[y] = change_span(h->fb + y * rowbytes, h->oldpix + y * rowbytes,
+                                   rowbytes, h->lossy, &last[y]);
+            if (first[y] < 0)
+                continue;
+            first[y] /= 3;
+            last[y] /= 3;
+        }
+        changed++;
+    }
+
+    if (changed > 0) {
+        n = plan_rects(h, first, last, rects, ST2205_MAX_RECTS);
+        st2205_send_rects(h, h->fb, rects, n);
+    }
+
+    free(first);
+#endif /* !_WIN32 */
+}
+
+/*
+ Asynchronous sending. st2205_submit() only copies the frame into pending
+ and wakes the I/O thread, which swaps it with work and sends that with
+ st2205_send_data(). A frame submitted before the last one was picked up
+ replaces it. Since changes are found against what is on the display, the
+ changes of the replaced frame are included. After every frame sent, the
+ eventfd is incremented. Encoding is done on this thread between writes,
+ so it only overlaps them within a frame, in streaming mode.
+ */
+#ifdef __linux__
+struct st2205_async {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char *pending;
+    unsigned char *work;
+    int have;
+    int stop;
+    int efd;
+};
+
+static int async_have(struct st2205_async *a)
+{
+    int have;
+
+    pthread_mutex_lock(&a->lock);
+    have = a->have;
+    pthread_mutex_unlock(&a->lock);
+
+    return have;
+}
+
+static void *async_thread(void *arg)
+{
+    st2205_handle *h = arg;
+    struct st2205_async *a = h->async;
+    unsigned char *t;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&a->lock);
+    for (;;) {
+        while (!a->have && !a->stop)
+            pthread_cond_wait(&a->cond, &a->lock);
+        if (!a->have)
+            break;
+
+        t = a->pending;
+        a->pending = a->work;
+        a->work = t;
+        a->have = 0;
+        pthread_mutex_unlock(&a->lock);
+
+        /* Progressive passes are only sent until a newer frame comes */
+        st2205_send_data(h, a->work);
+        while (!async_have(a) && st2205_refine(h) > 0);
+
+        if (write(a->efd, &one, sizeof(one)) < 0)
+            perror("libst2205: eventfd");
+
+        pthread_mutex_lock(&a->lock);
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    return NULL;
+}
+
+int st2205_async_start(st2205_handle *h)
+{
+    struct st2205_async *a;
+    int size = h->width * h->height * 3;
+
+    if (h->async != NULL)
+        return h->async->efd;
+
+    a = calloc(1, sizeof(*a));
+    if (a == NULL)
+        return -1;
+    a->pending = malloc(size);
+    a->work = malloc(size);
+    a->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (a->pending == NULL || a->work == NULL || a->efd < 0)
+        goto fail;
+
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->cond, NULL);
+    h->async = a;
+    if (pthread_create(&a->thread, NULL, async_thread, h) != 0) {
+        h->async = NULL;
+        pthread_cond_destroy(&a->cond);
+        pthread_mutex_destroy(&a->lock);
+        goto fail;
+    }
+
+    return a->efd;
+
+fail:
+    if (a->efd >= 0)
+        close(a->efd);
+    free(a->pending);
+    free(a->work);
+    free(a);
+    return -1;
+}
+
+void st2205_submit(st2205_handle *h, const unsigned char *pixinfo)
+{
+    struct st2205_async *a = h->async;
+
+    if (a == NULL) {
+        st2205_send_data(h, (unsigned char *)pixinfo);
+        return;
+    }
+
+    pthread_mutex_lock(&a->lock);
+    memcpy(a->pending, pixinfo, h->width * h->height * 3);
+    a->have = 1;
+    pthread_cond_signal(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+}
+
+void st2205_async_stop(st2205_handle *h)
+{
+    struct st2205_async *a = h->async;
+
+    if (a == NULL)
+        return;
+
+    pthread_mutex_lock(&a->lock);
+    a->stop = 1;
+    pthread_cond_signal(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+    pthread_join(a->thread, NULL);
+
+    h->async = NULL;
+    pthread_cond_destroy(&a->cond);
+    pthread_mutex_destroy(&a->lock);
+    close(a->efd);
+    free(a->pending);
+    free(a->work);
+    free(a);
+}
+#else /* !__linux__ */
+int st2205_async_start(st2205_handle *h)
+{
+    (void)h;
+    return -1;
+}
+
+void st2205_submit(st2205_handle *h, const unsigned char *pixinfo)
+{
+    st2205_send_data(h, (unsigned char *)pixinfo);
+}
+
+void st2205_async_stop(st2205_handle *h)
+{
+    (void)h;
+}
+#endif /* !__linux__ */
+
+/*
+ Multi-threaded drawing. Producers draw into the framebuffer from
+ st2205_mt_start() and post damage with st2205_post_damage(), which puts
+ it in a bounded lock-free queue and wakes the flusher thread. The flusher
+ takes everything posted so far, merges it into windows and sends them,
+ so damage posted during a transfer goes out together in the next one.
+ If the queue is full, the whole screen is sent instead. Slots carry a
+ sequence number saying whether they are free or filled for a position.
+ */
+#ifdef __linux__
+#define MT_QUEUE 256
+
+struct st2205_mt {
+    pthread_t thread;
+    sem_t wake;
+    unsigned char *fb;
+    unsigned int tail; /* Next position producers claim */
+    unsigned int head; /* Next position the flusher takes */
+    int overflow;
+    int stop;
+    struct {
+        unsigned int seq;
+        st2205_rect r;
+    } slot[MT_QUEUE];
+};
+
+static int mt_pop(struct st2205_mt *m, st2205_rect *r)
+{
+    unsigned int pos = m->head;
+
+    if (__atomic_load_n(&m->slot[pos % MT_QUEUE].seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return 0;
+
+    *r = m->slot[pos % MT_QUEUE].r;
+    __atomic_store_n(&m->slot[pos % MT_QUEUE].seq, pos + MT_QUEUE, __ATOMIC_RELEASE);
+    m->head = pos + 1;
+    return 1;
+}
+
+static void *mt_thread(void *arg)
+{
+    st2205_handle *h = arg;
+    struct st2205_mt *m = h->mt;
+    st2205_rect rects[ST2205_MAX_RECTS], r;
+    int *first, *last, stop, changed, y, n;
+
+    first = malloc(sizeof(int) * h->height * 2);
+    if (first == NULL)
+        return NULL;
+    last = first + h->height;
+
+    do {
+        while (sem_wait(&m->wake) < 0);
+        stop = __atomic_load_n(&m->stop, __ATOMIC_ACQUIRE);
+
+        for (y = 0; y < (int)h->height; y++) {
+            first[y] = -1;
+            last[y] = -1;
+        }
+
+        changed = 0;
+        if (__atomic_exchange_n(&m->overflow, 0, __ATOMIC_ACQ_REL)) {
+            for (y = 0; y < (int)h->height; y++) {
+                first[y] = 0;
+                last[y] = h->width - 1;
+            }
+            changed = 1;
+        }
+
+        while (mt_pop(m, &r)) {
+            if (r.xs < 0)
+                r.xs = 0;
+            if (r.ys < 0)
+                r.ys = 0;
+            if (r.xe >= (int)h->width)
+                r.xe = h->width - 1;
+            if (r.ye >= (int)h->height)
+                r.ye = h->height - 1;
+            for (y = r.ys; r.xs <= r.xe && y <= r.ye; y++) {
+                span_union(&first[y], &last[y], r.xs, r.xe);
+                changed = 1;
+            }
+        }
+
+        if (changed) {
+            n = plan_rects(h, first, last, rects, ST2205_MAX_RECTS);
+            write_rects(h, m->fb, rects, n);
+        }
+    } while (!stop);
+
+    free(first);
+    return NULL;
+}
+
+unsigned char *st2205_mt_start(st2205_handle *h)
+{
+    struct st2205_mt *m;
+    unsigned int i;
+
+    if (h->mt != NULL)
+        return h->mt->fb;
+
+    m = calloc(1, sizeof(*m));
+    if (m == NULL)
+        return NULL;
+    m->fb = calloc(h->width * h->height, 3);
+    if (m->fb == NULL || sem_init(&m->wake, 0, 0) < 0) {
+        free(m->fb);
+        free(m);
+        return NULL;
+    }
+    for (i = 0; i < MT_QUEUE; i++)
+        m->slot[i].seq = i;
+
+    /* Start with what is on the display, if that is known */
+    if (h->damage_mode == ST2205_DAMAGE_EXACT && h->oldpix != NULL)
+        memcpy(m->fb, h->oldpix, h->width * h->height * 3);
+
+    h->mt = m;
+    if (pthread_create(&m->thread, NULL, mt_thread, h) != 0) {
+        h->mt = NULL;
+        sem_destroy(&m->wake);
+        free(m->fb);
+        free(m);
+        return NULL;
+    }
+
+    return m->fb;
+}
+
+void st2205_post_damage(st2205_handle *h, int xs, int ys, int xe, int ye)
+{
+    struct st2205_mt *m = h->mt;
+    unsigned int pos, seq;
+
+    if (m == NULL)
+        return;
+
+    pos = __atomic_load_n(&m->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        seq = __atomic_load_n(&m->slot[pos % MT_QUEUE].seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&m->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if ((int)(seq - pos) < 0) {
+            /* Full */
+            __atomic_store_n(&m->overflow, 1, __ATOMIC_RELEASE);
+            sem_post(&m->wake);
+            return;
+        } else {
+            pos = __atomic_load_n(&m->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    m->slot[pos % MT_QUEUE].r.xs = xs;
+    m->slot[pos % MT_QUEUE].r.ys = ys;
+    m->slot[pos % MT_QUEUE].r.xe = xe;
+    m->slot[pos % MT_QUEUE].r.ye = ye;
+    __atomic_store_n(&m->slot[pos % MT_QUEUE].seq, pos + 1, __ATOMIC_RELEASE);
+    sem_post(&m->wake);
+}
+
+void st2205_mt_stop(st2205_handle *h)
+{
+    struct st2205_mt *m = h->mt;
+
+    if (m == NULL)
+        return;
+
+    __atomic_store_n(&m->stop, 1, __ATOMIC_RELEASE);
+    sem_post(&m->wake);
+    pthread_join(m->thread, NULL);
+
+    h->mt = NULL;
+    sem_destroy(&m->wake);
+    free(m->fb);
+    free(m);
+
+    /* Producers may have drawn after the last flush read the pixels */
+    st2205_invalidate(h);
+}
+#else /* !__linux__ */
+unsigned char *st2205_mt_start(st2205_handle *h)
+{
+    (void)h;
+    return NULL;
+}
+
+void st2205_post_damage(st2205_handle *h, int xs, int ys, int xe, int ye)
+{
+    (void)h;
+    (void)xs;
+    (void)ys;
+    (void)xe;
+    (void)ye;
+}
+
+void st2205_mt_stop(st2205_handle *h)
+{
+    (void)h;
+}
+#endif /* !__linux__ */
+
+/*
+ Compositor. Layers keep their own r,g,b,a pixels and are stacked by z
+ over a black background. Changes to a layer add its screen area to the
+ damage, kept as a span per row, and st2205_compose() recomposes only the
+ windows covering that, from all the layers, and sends them. A layer
+ going away is recomposed from the ones below without the application
+ redrawing anything.
+ */
+struct st2205_layer {
+    struct st2205_layer *next;
+    st2205_handle *h;
+    unsigned char *pix;
+    int x, y, width, height;
+    int z, alpha, visible;
+};
+
+struct st2205_comp {
+    st2205_layer *layers; /* Bottom first */
+    unsigned char *screen;
+    unsigned char *row;
+    int *first, *last;
+};
+
+static void comp_damage(st2205_handle *h, int xs, int ys, int xe, int ye)
+{
+    struct st2205_comp *c = h->comp;
+    int y;
+
+    if (xs < 0)
+        xs = 0;
+    if (ys < 0)
+        ys = 0;
+    if (xe >= (int)h->width)
+        xe = h->width - 1;
+    if (ye >= (int)h->height)
+        ye = h->height - 1;
+
+    for (y = ys; xs <= xe && y <= ye; y++)
+        span_union(&c->first[y], &c->last[y], xs, xe);
+}
+
+static void layer_damage(st2205_layer *l)
+{
+    if (l->visible)
+        comp_damage(l->h, l->x, l->y, l->x + l->width - 1, l->y + l->height - 1);
+}
+
+static struct st2205_comp *comp_get(st2205_handle *h)
+{
+    struct st2205_comp *c;
+    int y;
+
+    if (h->comp != NULL)
+        return h->comp;
+
+    c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return NULL;
+    c->screen = malloc(h->width * h->height * 3);
+    c->row = malloc(h->width * 4);
+    c->first = malloc(sizeof(int) * h->height * 2);
+    if (c->screen == NULL || c->row == NULL || c->first == NULL) {
+        free(c->screen);
+        free(c->row);
+        free(c->first);
+        free(c);
+        return NULL;
+    }
+    c->last = c->first + h->height;
+
+    /* The first compose paints everything */
+    for (y = 0; y < (int)h->height; y++) {
+        c->first[y] = 0;
+        c->last[y] = h->width - 1;
+    }
+
+    h->comp = c;
+    return c;
+}
+
+static void layer_unlink(st2205_layer *l)
+{
+    st2205_layer **link;
+
+    for (link = &l->h->comp->layers; *link != NULL; link = &(*link)->next) {
+        if (*link == l) {
+            *link = l->next;
+            return;
+        }
+    }
+}
+
+static void layer_link(st2205_layer *l)
+{
+    st2205_layer **link;
+
+    link = &l->h->comp->layers;
+    while (*link != NULL && (*link)->z <= l->z)
+        link = &(*link)->next;
+    l->next = *link;
+    *link = l;
+}
+
+st2205_layer *st2205_layer_new(st2205_handle *h, int width, int height, int x, int y, int z)
+{
+    st2205_layer *l;
+
+    if (width <= 0 || height <= 0 || comp_get(h) == NULL)
+        return NULL;
+
+    l = malloc(sizeof(*l));
+    if (l == NULL)
+        return NULL;
+    l->pix = calloc(width * height, 4);
+    if (l->pix == NULL) {
+        free(l);
+        return NULL;
+    }
+    l->h = h;
+    l->x = x;
+    l->y = y;
+    l->width = width;
+    l->height = height;
+    l->z = z;
+    l->alpha = 255;
+    l->visible = 1;
+
+    layer_link(l);
+    layer_damage(l);
+    return l;
+}
+
+unsigned char *st2205_layer_pixels(st2205_layer *l)
+{
+    return l->pix;
+}
+
+void st2205_layer_damage(st2205_layer *l, int xs, int ys, int xe, int ye)
+{
+    if (xs < 0)
+        xs = 0;
+    if (ys < 0)
+        ys = 0;
+    if (xe >= l->width)
+        xe = l->width - 1;
+    if (ye >= l->height)
+        ye = l->height - 1;
+
+    if (l->visible && xs <= xe && ys <= ye)
+        comp_damage(l->h, l->x + xs, l->y + ys, l->x + xe, l->y + ye);
+}
+
+/*
+ Only what the layer covered before and covers now gets recomposed.
+ */
+void st2205_layer_move(st2205_layer *l, int x, int y)
+{
+    layer_damage(l);
+    l->x = x;
+    l->y = y;
+    layer_damage(l);
+}
+
+void st2205_layer_set_z(st2205_layer *l, int z)
+{
+    layer_unlink(l);
+    l->z = z;
+    layer_link(l);
+    layer_damage(l);
+}
+
+void st2205_layer_set_alpha(st2205_layer *l, int alpha)
+{
+    l->alpha = alpha < 0 ? 0 : alpha > 255 ? 255 : alpha;
+    layer_damage(l);
+}
+
+void st2205_layer_show(st2205_layer *l, int visible)
+{
+    layer_damage(l);
+    l->visible = visible;
+    layer_damage(l);
+}
+
+void st2205_layer_free(st2205_layer *l)
+{
+    layer_damage(l);
+    layer_unlink(l);
+    free(l->pix);
+    free(l);
+}
+
+/*
+ Composes row y from xs to xe, inclusive, into the screen.
+ */
+static void compose_row(st2205_handle *h, int y, int xs, int xe)
+{
+    struct st2205_comp *c = h->comp;
+    st2205_layer *l;
+    int sx, ex, i;
+
+    for (i = 0; i <= xe - xs; i++) {
+        c->row[i * 4] = 0;
+        c->row[i * 4 + 1] = 0;
+        c->row[i * 4 + 2] = 0;
+        c->row[i * 4 + 3] = 255;
+    }
+
+    for (l = c->layers; l != NULL; l = l->next) {
+        if (!l->visible || l->alpha == 0 || y < l->y || y >= l->y + l->height)
+            continue;
+        sx = l->x > xs ? l->x : xs;
+        ex = l->x + l->width - 1 < xe ? l->x + l->width - 1 : xe;
+        if (sx > ex)
+            continue;
+        blend_row(c->row + (sx - xs) * 4,
+                  l->pix + ((y - l->y) * l->width + sx - l->x) * 4, ex - sx + 1, l->alpha);
+    }
+
+    convert_row(ST2205_FMT_RGBA, c->row, c->screen + (y * h->width + xs) * 3, xe - xs + 1);
+}
+
+void st2205_compose(st2205_handle *h)
+{
+    struct st2205_comp *c = h->comp;
+    st2205_rect rects[ST2205_MAX_RECTS];
+    int i, n, y, s, e, rowbytes;
+
+    if (c == NULL)
+        return;
+
+    n = plan_rects(h, c->first, c->last, rects, ST2205_MAX_RECTS);
+    if (n == 0)
+        return;
+
+    /* The windows also cover pixels between damaged ones, so do those too */
+    for (y = 0; y < (int)h->height; y++) {
+        c->first[y] = -1;
+        c->last[y] = -1;
+    }
+    rowbytes = h->width * 3;
+    for (i = 0; i < n; i++) {
+        for (y = rects[i].ys; y <= rects[i].ye; y++) {
+            compose_row(h, y, rects[i].xs, rects[i].xe);
+
+            /* Damage which ends up looking the same needn't be sent */
+            if (h->damage_mode == ST2205_DAMAGE_EXACT && h->oldpix != NULL) {
+                s = change_span(c->screen + y * rowbytes + rects[i].xs * 3,
+                                h->oldpix + y * rowbytes + rects[i].xs * 3,
+                                (rects[i].xe - rects[i].xs + 1) * 3, 0, &e);
+                if (s >= 0)
+                    span_union(&c->first[y], &c->last[y],
+                               rects[i].xs + s / 3, rects[i].xs + e / 3);
+            } else {
+                span_union(&c->first[y], &c->last[y], rects[i].xs, rects[i].xe);
+            }
+        }
+    }
+
+    n = plan_rects(h, c->first, c->last, rects, ST2205_MAX_RECTS);
+    if (n > 0)
+        st2205_send_rects(h, c->screen, rects, n);
+
+    for (y = 0; y < (int)h->height; y++) {
+        c->first[y] = -1;
+        c->last[y] = -1;
+    }
+}
+
+static void comp_free(st2205_handle *h)
+{
+    struct st2205_comp *c = h->comp;
+    st2205_layer *l;
+
+    if (c == NULL)
+        return;
+
+    while ((l = c->layers) != NULL) {
+        c->layers = l->next;
+        free(l->pix);
+        free(l);
+    }
+    free(c->screen);
+    free(c->row);
+    free(c->first);
+    free(c);
+    h->comp = NULL;
+}
+
+/*
+ Persistent shadow. The state file holds the shadow along with what
+ identifies the display it belongs to: the USB bus and device numbers,
+ which change when it is plugged in again, its serial number and the
+ boot. A process which closes the handle leaves the file marked valid,
+ and the next one to open the same display picks up from there.
+ */
+#ifdef __linux__
+static int device_key(int fd, char *key, int size)
+{
+    char dir[PATH_MAX];
+    char boot[64], bus[16], dev[16], serial[128];
+    struct stat st;
+
+    if (fstat(fd, &st) < 0 || read_line("/proc/sys/kernel/random", "boot_id", boot, sizeof(boot)) <= 0)
+        return -1;
+
+    /* An image file for testing is known by its inode */
+    if (!S_ISBLK(st.st_mode) && !S_ISCHR(st.st_mode)) {
+        snprintf(key, size, "%s file %lu:%lu", boot, (unsigned long)st.st_dev, (unsigned long)st.st_ino);
+        return 0;
+    }
+
+    if (usb_device_dir(&st, dir) < 0 ||
+        read_line(dir, "busnum", bus, sizeof(bus)) <= 0 ||
+        read_line(dir, "devnum", dev, sizeof(dev)) <= 0)
+        return -1;
+    if (read_line(dir, "serial", serial, sizeof(serial)) < 0)
+        serial[0] = 0;
+
+    snprintf(key, size, "%s usb %s:%s %s", boot, bus, dev, serial);
+    return 0;
+}
+
+int st2205_set_state_file(st2205_handle *h, const char *path)
+{
+    struct st2205_state *st;
+    char key[sizeof(st->key)];
+    long size = STATE_PIXELS + (long)h->width * h->height * 3;
+    int fd, restored = 0;
+
+    if (h->state != NULL || device_key(h->fd, key, sizeof(key)) < 0)
+        return -1;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    /* Only one process may own it */
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0 || ftruncate(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+    st = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (st == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    if (memcmp(st->magic, STATE_MAGIC, sizeof(st->magic)) == 0 &&
+        st->valid && (st->gen & 1) == 0 &&
+        st->width == h->width && st->height == h->height &&
+        st->bpp == h->bpp && st->proto == h->proto && st->orient == h->orient &&
+        strncmp(st->key, key, sizeof(st->key)) == 0)
+        restored = 1;
+
+    if (!restored) {
+        memcpy(st->magic, STATE_MAGIC, sizeof(st->magic));
+        st->gen = 0;
+        st->width = h->width;
+        st->height = h->height;
+        st->bpp = h->bpp;
+        st->proto = h->proto;
+        st->orient = h->orient;
+        strncpy(st->key, key, sizeof(st->key));
+    }
+    /* Until st2205_close(), what is in the file can't be trusted */
+    st->valid = 0;
+    __atomic_add_fetch(&st->gen, 1, __ATOMIC_RELEASE);
+    msync(st, STATE_PIXELS, MS_SYNC);
+
+    /* A shadow this process already has is newer */
+    if (h->oldpix != NULL) {
+        memcpy((unsigned char *)st + STATE_PIXELS, h->oldpix, size - STATE_PIXELS);
+        restored = 0;
+        free(h->oldpix);
+        h->oldpix = (unsigned char *)st + STATE_PIXELS;
+    } else if (restored) {
+        h->oldpix = (unsigned char *)st + STATE_PIXELS;
+    }
+    h->state = st;
+    h->statefd = fd;
+
+    return restored;
+}
+
+static void state_close(st2205_handle *h)
+{
+    struct st2205_state *st = h->state;
+    long size = STATE_PIXELS + (long)h->width * h->height * 3;
+
+    if (st == NULL)
+        return;
+
+    /* The shadow has to be on disk before it is marked valid */
+    if (h->oldpix != NULL) {
+        msync(st, size, MS_SYNC);
+        st->valid = 1;
+    }
+    __atomic_add_fetch(&st->gen, 1, __ATOMIC_RELEASE);
+    msync(st, STATE_PIXELS, MS_SYNC);
+
+    munmap(st, size);
+    close(h->statefd);
+    h->state = NULL;
+    h->statefd = -1;
+    h->oldpix = NULL;
+}
+#else /* !__linux__ */
+int st2205_set_state_file(st2205_handle *h, const char *path)
+{
+    (void)h;
+    (void)path;
+    return -1;
+}
+
+static void state_close(st2205_handle *h)
+{
+    (void)h;
+}
+#endif /* !__linux__ */
+
+/*
+ Text. Fonts are bitmaps, one bit per pixel with the leftmost pixel in the
+ top bit, and rows padded to whole bytes, as in PSF fonts. For each font,
+ scale and pair of colors, glyphs are drawn and encoded once, the first
+ time they are shown, and then kept as packets. Setting a label sends a
+ window and the kept packets for each cell that changed, all in one write.
+ */
+struct st2205_font {
+    int width, height;
+    int first, count;   /* Glyphs for characters first to first+count-1 */
+    int rowbytes;
+    const unsigned char *bits;
+    unsigned char *mem;
+    int refs;           /* Owner and glyph caches, for loaded fonts */
+    int released;       /* st2205_font_free() was called */
+};
+
+/*
+ The 8x8 font used when none is given: ASCII from the IBM PC BIOS font.
+ */
+static const unsigned char font8x8[95 * 8] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /*   */
+    0x18, 0x3c, 0x3c, 0x18, 0x18, 0x00, 0x18, 0x00,  /* ! */
+    0x6c, 0x6c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* " */
+    0x6c, 0x6c, 0xfe, 0x6c, 0xfe, 0x6c, 0x6c, 0x00,  /* # */
+    0x30, 0x7c, 0xc0, 0x78, 0x0c, 0xf8, 0x30, 0x00,  /* $ */
+    0x00, 0xc6, 0xcc, 0x18, 0x30, 0x66, 0xc6, 0x00,  /* % */
+    0x38, 0x6c, 0x38, 0x76, 0xdc, 0xcc, 0x76, 0x00,  /* & */
+    0x60, 0x60, 0xc0, 0x00, 0x00, 0x00, 0x00, 0x00,  /* ' */
+    0x18, 0x30, 0x60, 0x60, 0x60, 0x30, 0x18, 0x00,  /* ( */
+    0x60, 0x30, 0x18, 0x18, 0x18, 0x30, 0x60, 0x00,  /* ) */
+    0x00, 0x66, 0x3c, 0xff, 0x3c, 0x66, 0x00, 0x00,
+    0x00, 0x30, 0x30, 0xfc, 0x30, 0x30, 0x00, 0x00,  /* + */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x30, 0x30, 0x60,  /* , */
+    0x00, 0x00, 0x00, 0xfc, 0x00, 0x00, 0x00, 0x00,  /* - */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x30, 0x30, 0x00,  /* . */
+    0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0, 0x80, 0x00,
+    0x7c, 0xc6, 0xce, 0xde, 0xf6, 0xe6, 0x7c, 0x00,  /* 0 */
+    0x30, 0x70, 0x30, 0x30, 0x30, 0x30, 0xfc, 0x00,  /* 1 */
+    0x78, 0xcc, 0x0c, 0x38, 0x60, 0xcc, 0xfc, 0x00,  /* 2 */
+    0x78, 0xcc, 0x0c, 0x38, 0x0c, 0xcc, 0x78, 0x00,  /* 3 */
+    0x1c, 0x3c, 0x6c, 0xcc, 0xfe, 0x0c, 0x1e, 0x00,  /* 4 */
+    0xfc, 0xc0, 0xf8, 0x0c, 0x0c, 0xcc, 0x78, 0x00,  /* 5 */
+    0x38, 0x60, 0xc0, 0xf8, 0xcc, 0xcc, 0x78, 0x00,  /* 6 */
+    0xfc, 0xcc, 0x0c, 0x18, 0x30, 0x30, 0x30, 0x00,  /* 7 */
+    0x78, 0xcc, 0xcc, 0x78, 0xcc, 0xcc, 0x78, 0x00,  /* 8 */
+    0x78, 0xcc, 0xcc, 0x7c, 0x0c, 0x18, 0x70, 0x00,  /* 9 */
+    0x00, 0x30, 0x30, 0x00, 0x00, 0x30, 0x30, 0x00,  /* : */
+    0x00, 0x30, 0x30, 0x00, 0x00, 0x30, 0x30, 0x60,  /* ; */
+    0x18, 0x30, 0x60, 0xc0, 0x60, 0x30, 0x18, 0x00,  /* < */
+    0x00, 0x00, 0xfc, 0x00, 0x00, 0xfc, 0x00, 0x00,  /* = */
+    0x60, 0x30, 0x18, 0x0c, 0x18, 0x30, 0x60, 0x00,  /* > */
+    0x78, 0xcc, 0x0c, 0x18, 0x30, 0x00, 0x30, 0x00,  /* ? */
+    0x7c, 0xc6, 0xde, 0xde, 0xde, 0xc0, 0x78, 0x00,  /* @ */
+    0x30, 0x78, 0xcc, 0xcc, 0xfc, 0xcc, 0xcc, 0x00,  /* A */
+    0xfc, 0x66, 0x66, 0x7c, 0x66, 0x66, 0xfc, 0x00,  /* B */
+    0x3c, 0x66, 0xc0, 0xc0, 0xc0, 0x66, 0x3c, 0x00,  /* C */
+    0xf8, 0x6c, 0x66, 0x66, 0x66, 0x6c, 0xf8, 0x00,  /* D */
+    0xfe, 0x62, 0x68, 0x78, 0x68, 0x62, 0xfe, 0x00,  /* E */
+    0xfe, 0x62, 0x68, 0x78, 0x68, 0x60, 0xf0, 0x00,  /* F */
+    0x3c, 0x66, 0xc0, 0xc0, 0xce, 0x66, 0x3e, 0x00,  /* G */
+    0xcc, 0xcc, 0xcc, 0xfc, 0xcc, 0xcc, 0xcc, 0x00,  /* H */
+    0x78, 0x30, 0x30, 0x30, 0x30, 0x30, 0x78, 0x00,  /* I */
+    0x1e, 0x0c, 0x0c, 0x0c, 0xcc, 0xcc, 0x78, 0x00,  /* J */
+    0xe6, 0x66, 0x6c, 0x78, 0x6c, 0x66, 0xe6, 0x00,  /* K */
+    0xf0, 0x60, 0x60, 0x60, 0x62, 0x66, 0xfe, 0x00,  /* L */
+    0xc6, 0xee, 0xfe, 0xfe, 0xd6, 0xc6, 0xc6, 0x00,  /* M */
+    0xc6, 0xe6, 0xf6, 0xde, 0xce, 0xc6, 0xc6, 0x00,  /* N */
+    0x38, 0x6c, 0xc6, 0xc6, 0xc6, 0x6c, 0x38, 0x00,  /* O */
+    0xfc, 0x66, 0x66, 0x7c, 0x60, 0x60, 0xf0, 0x00,  /* P */
+    0x78, 0xcc, 0xcc, 0xcc, 0xdc, 0x78, 0x1c, 0x00,  /* Q */
+    0xfc, 0x66, 0x66, 0x7c, 0x6c, 0x66, 0xe6, 0x00,  /* R */
+    0x78, 0xcc, 0xe0, 0x70, 0x1c, 0xcc, 0x78, 0x00,  /* S */
+    0xfc, 0xb4, 0x30, 0x30, 0x30, 0x30, 0x78, 0x00,  /* T */
+    0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xfc, 0x00,  /* U */
+    0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0x78, 0x30, 0x00,  /* V */
+    0xc6, 0xc6, 0xc6, 0xd6, 0xfe, 0xee, 0xc6, 0x00,  /* W */
+    0xc6, 0xc6, 0x6c, 0x38, 0x38, 0x6c, 0xc6, 0x00,  /* X */
+    0xcc, 0xcc, 0xcc, 0x78, 0x30, 0x30, 0x78, 0x00,  /* Y */
+    0xfe, 0xc6, 0x8c, 0x18, 0x32, 0x66, 0xfe, 0x00,  /* Z */
+    0x78, 0x60, 0x60, 0x60, 0x60, 0x60, 0x78, 0x00,  /* [ */
+    0xc0, 0x60, 0x30, 0x18, 0x0c, 0x06, 0x02, 0x00,
+    0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0x78, 0x00,  /* ] */
+    0x10, 0x38, 0x6c, 0xc6, 0x00, 0x00, 0x00, 0x00,  /* ^ */
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff,  /* _ */
+    0x30, 0x30, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00,  /* ` */
+    0x00, 0x00, 0x78, 0x0c, 0x7c, 0xcc, 0x76, 0x00,  /* a */
+    0xe0, 0x60, 0x60, 0x7c, 0x66, 0x66, 0xdc, 0x00,  /* b */
+    0x00, 0x00, 0x78, 0xcc, 0xc0, 0xcc, 0x78, 0x00,  /* c */
+    0x1c, 0x0c, 0x0c, 0x7c, 0xcc, 0xcc, 0x76, 0x00,  /* d */
+    0x00, 0x00, 0x78, 0xcc, 0xfc, 0xc0, 0x78, 0x00,  /* e */
+    0x38, 0x6c, 0x60, 0xf0, 0x60, 0x60, 0xf0, 0x00,  /* f */
+    0x00, 0x00, 0x76, 0xcc, 0xcc, 0x7c, 0x0c, 0xf8,  /* g */
+    0xe0, 0x60, 0x6c, 0x76, 0x66, 0x66, 0xe6, 0x00,  /* h */
+    0x30, 0x00, 0x70, 0x30, 0x30, 0x30, 0x78, 0x00,  /* i */
+    0x0c, 0x00, 0x0c, 0x0c, 0x0c, 0xcc, 0xcc, 0x78,  /* j */
+    0xe0, 0x60, 0x66, 0x6c, 0x78, 0x6c, 0xe6, 0x00,  /* k */
+    0x70, 0x30, 0x30, 0x30, 0x30, 0x30, 0x78, 0x00,  /* l */
+    0x00, 0x00, 0xcc, 0xfe, 0xfe, 0xd6, 0xc6, 0x00,  /* m */
+    0x00, 0x00, 0xf8, 0xcc, 0xcc, 0xcc, 0xcc, 0x00,  /* n */
+    0x00, 0x00, 0x78, 0xcc, 0xcc, 0xcc, 0x78, 0x00,  /* o */
+    0x00, 0x00, 0xdc, 0x66, 0x66, 0x7c, 0x60, 0xf0,  /* p */
+    0x00, 0x00, 0x76, 0xcc, 0xcc, 0x7c, 0x0c, 0x1e,  /* q */
+    0x00, 0x00, 0xdc, 0x76, 0x66, 0x60, 0xf0, 0x00,  /* r */
+    0x00, 0x00, 0x7c, 0xc0, 0x78, 0x0c, 0xf8, 0x00,  /* s */
+    0x10, 0x30, 0x7c, 0x30, 0x30, 0x34, 0x18, 0x00,  /* t */
+    0x00, 0x00, 0xcc, 0xcc, 0xcc, 0xcc, 0x76, 0x00,  /* u */
+    0x00, 0x00, 0xcc, 0xcc, 0xcc, 0x78, 0x30, 0x00,  /* v */
+    0x00, 0x00, 0xc6, 0xd6, 0xfe, 0xfe, 0x6c, 0x00,  /* w */
+    0x00, 0x00, 0xc6, 0x6c, 0x38, 0x6c, 0xc6, 0x00,  /* x */
+    0x00, 0x00, 0xcc, 0xcc, 0xcc, 0x7c, 0x0c, 0xf8,  /* y */
+    0x00, 0x00, 0xfc, 0x98, 0x30, 0x64, 0xfc, 0x00,  /* z */
+    0x1c, 0x30, 0x30, 0xe0, 0x30, 0x30, 0x1c, 0x00,  /* { */
+    0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00,  /* | */
+    0xe0, 0x30, 0x30, 0x1c, 0x30, 0x30, 0xe0, 0x00,  /* } */
+    0x76, 0xdc, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  /* ~ */
+};
+
+static const st2205_font builtin_font = { 8, 8, 32, 95, 1, font8x8, NULL, 0, 0 };
+
+/*
+ Loads a PSF font, version 1 or 2. Characters are glyph numbers, without
+ going through any Unicode table.
+ */
+st2205_font *st2205_font_load(const char *path)
+{
+    st2205_font *f;
+    unsigned char *m;
+    FILE *fp;
+    long size;
+    uint32_t hdr, len, charsize;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    f = calloc(1, sizeof(*f));
+    m = size >= 32 ? malloc(size) : NULL;
+    if (f == NULL || m == NULL || fread(m, 1, size, fp) != (size_t)size) {
+        fclose(fp);
+        free(f);
+        free(m);
+        return NULL;
+    }
+    fclose(fp);
+    f->mem = m;
+    f->refs = 1;
+
+#define LE32(p) ((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8 | (uint32_t)(p)[2] << 16 | (uint32_t)(p)[3] << 24)
+    if (m[0] == 0x36 && m[1] == 0x04) {
+        f->width = 8;
+        f->height = m[3];
+        f->count = (m[2] & 1) ? 512 : 256;
+        hdr = 4;
+    } else if (m[0] == 0x72 && m[1] == 0xb5 && m[2] == 0x4a && m[3] == 0x86) {
+        hdr = LE32(m + 8);
+        len = LE32(m + 16);
+        charsize = LE32(m + 20);
+        f->height = LE32(m + 24);
+        f->width = LE32(m + 28);
+        f->count = len > 65536 ? 65536 : len;
+        if (f->width < 1 || f->width > 64 || charsize != (uint32_t)(f->width + 7) / 8 * f->height)
+            f->height = 0;
+    } else {
+        f->height = 0;
+        hdr = 0;
+    }
+#undef LE32
+    f->rowbytes = (f->width + 7) / 8;
+    f->first = 0;
+    f->bits = m + hdr;
+
+    if (f->height < 1 || f->height > 64 ||
+        (long)hdr + (long)f->count * f->rowbytes * f->height > size) {
+        free(m);
+        free(f);
+        return NULL;
+    }
+
+    return f;
+}
+
+/*
+ Glyphs made from a font keep a reference to it, so the font only goes
+ when they do too. The built in font has no memory to free.
+ */
+static st2205_font *font_ref(const st2205_font *f)
+{
+    st2205_font *m = (st2205_font *)f;
+
+    if (m->mem != NULL)
+        m->refs++;
+    return m;
+}
+
+static void font_unref(st2205_font *f)
+{
+    if (f->mem != NULL && --f->refs == 0) {
+        free(f->mem);
+        free(f);
+    }
+}
+
+void st2205_font_free(st2205_font *f)
+{
+    if (f != NULL && f->mem != NULL && !f->released) {
+        f->released = 1;
+        font_unref(f);
+    }
+}
+
+/*
+ Glyphs of one font, scale and pair of colors, drawn as r,g,b triplets,
+ and encoded as packets which go after a window.
+ */
+#define GLYPHS 256
+
+struct st2205_glyphs {
+    struct st2205_glyphs *next;
+    st2205_font *font;
+    int labels;         /* Labels using these */
+    int scale;
+    uint32_t fg, bg;
+    int bpp, proto;
+    int w, h;           /* Cell size */
+    unsigned char *rgb[GLYPHS];
+    char *wire[GLYPHS];
+    int len[GLYPHS];
+};
+
+struct st2205_label {
+    st2205_handle *h;
+    struct st2205_glyphs *g;
+    unsigned int width, height; /* Of the display, when made */
+    int orient;
+    int x, y, cols;
+    unsigned char *shown; /* Characters on the display, 0 for unknown */
+};
+
+static void clear_glyphs(struct st2205_glyphs *g)
+{
+    int i;
+
+    for (i=0; i<GLYPHS; i++) {
+        free(g->rgb[i]);
+        free(g->wire[i]);
+        g->rgb[i] = NULL;
+        g->wire[i] = NULL;
+    }
+}
+
+/*
+ Draws and encodes glyph c, if that wasn't done yet. Returns -1 when out
+ of memory.
+ */
+static int make_glyph(struct st2205_glyphs *g, const struct st2205_encoder *enc, int c)
+{
+    const st2205_font *f = g->font;
+    const unsigned char *row;
+    unsigned char *d;
+    uint32_t color;
+    int x, y, n, glyph;
+
+    if (g->wire[c] != NULL)
+        return 0;
+
+    g->rgb[c] = malloc(g->w * g->h * 3);
+    g->wire[c] = malloc(g->w * g->h * 3 + g->h * 64 + 64);
+    if (g->rgb[c] == NULL || g->wire[c] == NULL) {
+        free(g->rgb[c]);
+        free(g->wire[c]);
+        g->rgb[c] = NULL;
+        g->wire[c] = NULL;
+        return -1;
+    }
+
+    /* Characters the font doesn't have are blank */
+    glyph = c - f->first;
+    d = g->rgb[c];
+    for (y=0; y<g->h; y++) {
+        row = f->bits + ((long)glyph * f->height + y / g->scale) * f->rowbytes;
+        for (x=0; x<g->w; x++, d+=3) {
+            n = x / g->scale;
+            color = g->bg;
+            if (glyph >= 0 && glyph < f->count && n < f->width && (row[n >> 3] & (0x80 >> (n & 7))))
+                color = g->fg;
+            d[0] = color >> 16;
+            d[1] = color >> 8;
+            d[2] = color;
+        }
+    }
+
+    n = enc->rows(g->wire[c], 0, g->rgb[c], g->w * 3, g->w, g->h);
+    g->len[c] = enddata(g->wire[c], n);
+    return 0;
+}
+
+/*
+ Frees glyphs which no label uses, of fonts which st2205_font_free() was
+ called for, or all glyphs. Other unused glyphs are kept in case they are
+ shown again.
+ */
+static void glyphs_sweep(st2205_handle *h, int all)
+{
+    struct st2205_glyphs **p = &h->glyphs, *g;
+
+    while ((g = *p) != NULL) {
+        if (all || (g->labels == 0 && g->font->released)) {
+            *p = g->next;
+            clear_glyphs(g);
+            font_unref(g->font);
+            free(g);
+        } else {
+            p = &g->next;
+        }
+    }
+}
+
+st2205_label *st2205_label_new(st2205_handle *h, const st2205_font *font, int scale,
+                               int x, int y, int cols, uint32_t fg, uint32_t bg)
+{
+    struct st2205_glyphs *g;
+    st2205_label *l;
+    int w;
+
+    if (font == NULL)
+        font = &builtin_font;
+    if (scale < 1)
+        scale = 1;
+    fg &= 0xffffff;
+    bg &= 0xffffff;
+
+    /* 12 bpp sends pixels in pairs */
+    w = font->width * scale;
+    if (h->bpp == 12) {
+        w += w & 1;
+        x &= ~1;
+    }
+    if (cols < 1 || x < 0 || y < 0 || x + w * cols > (int)h->width ||
+        y + font->height * scale > (int)h->height)
+        return NULL;
+
+    glyphs_sweep(h, 0);
+    for (g = h->glyphs; g != NULL; g = g->next) {
+        if (g->font == font && g->scale == scale && g->fg == fg && g->bg == bg)
+            break;
+    }
+    if (g == NULL) {
+        g = calloc(1, sizeof(*g));
+        if (g == NULL)
+            return NULL;
+        g->font = font_ref(font);
+        g->scale = scale;
+        g->fg = fg;
+        g->bg = bg;
+        g->w = w;
+        g->h = font->height * scale;
+        g->next = h->glyphs;
+        h->glyphs = g;
+    }
+
+    l = malloc(sizeof(*l));
+    if (l == NULL)
+        return NULL;
+    l->shown = calloc(cols, 1);
+    if (l->shown == NULL) {
+        free(l);
+        return NULL;
+    }
+    l->h = h;
+    l->g = g;
+    g->labels++;
+    l->width = h->width;
+    l->height = h->height;
+    l->orient = h->orient;
+    l->x = x;
+    l->y = y;
+    l->cols = cols;
+    return l;
+}
+
+int st2205_label_set(st2205_label *l, const char *text)
+{
+    st2205_handle *h = l->h;
+    struct st2205_glyphs *g = l->g;
+    const struct st2205_encoder *enc;
+    struct out o;
+    unsigned char c;
+    int i, y, xs, sent = 0, end = 0;
+
+    if (l->width != h->width || l->height != h->height || l->orient != h->orient)
+        return -1;
+    enc = get_encoder(h);
+    if (enc == NULL)
+        return -1;
+
+    /* Packets are only good for the bpp and protocol they were made for */
+    if (g->bpp != h->bpp || g->proto != h->proto) {
+        clear_glyphs(g);
+        g->bpp = h->bpp;
+        g->proto = h->proto;
+    }
+
+    out_begin(h, &o);
+    for (i=0; i<l->cols; i++) {
+        if (!end && text[i] == 0)
+            end = 1;
+        c = end ? ' ' : (unsigned char)text[i];
+        if (c == l->shown[i])
+            continue;
+        if (make_glyph(g, enc, c) < 0)
+            break;
+
+        xs = l->x + i * g->w;
+        out_room(&o, g->len[c] + 128);
+        o.p = enc->setwin(h, o.buff, o.p, xs, xs + g->w - 1, l->y, l->y + g->h - 1);
+        memcpy(o.buff + o.p, g->wire[c], g->len[c]);
+        o.p += g->len[c];
+
+        if (h->damage_mode == ST2205_DAMAGE_EXACT && h->oldpix != NULL) {
+            for (y=0; y<g->h; y++) {
+                memcpy(h->oldpix + ((l->y + y) * h->width + xs) * 3,
+                       g->rgb[c] + y * g->w * 3, g->w * 3);
+            }
+        } else {
+            track_rect(h, NULL, xs, l->y, xs + g->w - 1, l->y + g->h - 1);
+        }
+        l->shown[i] = c;
+        sent++;
+    }
+    out_end(&o);
+
+    return sent;
+}
+
+/*
+ Makes the next st2205_label_set() send every cell.
+ */
+void st2205_label_redraw(st2205_label *l)
+{
+    memset(l->shown, 0, l->cols);
+}
+
+void st2205_label_free(st2205_label *l)
+{
+    if (l != NULL) {
+        l->g->labels--;
+        glyphs_sweep(l->h, 0);
+        free(l->shown);
+        free(l);
+    }
+}
+
+/*
+ Widgets. A screen of text, bars, graphs and images, read from a file
+ in the format described in st2205.h. Widgets draw into a screen kept here and note damage as a span
+ per row, and st2205_ui_update() sends just that, without comparing
+ frames. Text goes through labels, which send only cells that changed.
+ */
+enum { UI_TEXT, UI_BAR, UI_GRAPH, UI_IMAGE };
+
+struct ui_widget {
+    char name[32];
+    int type;
+    int x, y, w, h;
+    uint32_t fg, bg;
+    double min, max;
+    int fill;           /* Bar: columns filled */
+    int cursor, sweep;  /* Graph: next column, and how it moves */
+    st2205_font *font;  /* One of the UI's fonts */
+    st2205_label *label;
+    char *text;         /* Text to show on the next update, or NULL */
+};
+
+/*
+ Fonts are loaded once per file name, so widgets using the same one share
+ glyphs.
+ */
+struct ui_font {
+    struct ui_font *next;
+    st2205_font *font;
+    char path[];
+};
+
+struct st2205_ui {
+    st2205_handle *h;
+    unsigned char *screen;
+    int *first, *last;
+    struct ui_widget *w;
+    int n;
+    struct ui_font *fonts;
+    unsigned int width, height; /* Of the display, when loaded */
+    int orient;
+};
+
+/*
+ The screen and the damage spans are for the display as it was.
+ */
+static int ui_stale(st2205_ui *ui)
+{
+    return ui->width != ui->h->width || ui->height != ui->h->height ||
+           ui->orient != ui->h->orient;
+}
+
+static void ui_damage(st2205_ui *ui, int xs, int ys, int xe, int ye)
+{
+    int y;
+
+    for (y=ys; y<=ye; y++)
+        span_union(&ui->first[y], &ui->last[y], xs, xe);
+}
+
+static void ui_fill(st2205_ui *ui, int xs, int ys, int xe, int ye, uint32_t color)
+{
+    unsigned char *d;
+    int x, y;
+
+    for (y=ys; y<=ye; y++) {
+        d = ui->screen + (y * ui->width + xs) * 3;
+        for (x=xs; x<=xe; x++, d+=3) {
+            d[0] = color >> 16;
+            d[1] = color >> 8;
+            d[2] = color;
+        }
+    }
+    ui_damage(ui, xs, ys, xe, ye);
+}
+
+/*
+ Reads a binary PPM into the screen at (x,y), clipped to it.
+ */
+static int ui_ppm(st2205_ui *ui, struct ui_widget *w, const char *path)
+{
+    st2205_handle *h = ui->h;
+    unsigned char *row;
+    FILE *f;
+    int c, i, x, y, v[3], ok = 0;
+
+    f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+    if (fgetc(f) != 'P' || fgetc(f) != '6')
+        goto out;
+    for (i=0; i<3; i++) {
+        /* Skip space and comments */
+        while ((c = fgetc(f)) == '#' || (c != EOF && c <= ' ')) {
+            if (c == '#')
+                while ((c = fgetc(f)) != '\n' && c != EOF);
+        }
+        ungetc(c, f);
+        if (fscanf(f, "%d", &v[i]) != 1)
+            goto out;
+    }
+    fgetc(f);
+    if (v[0] < 1 || v[1] < 1 || v[2] != 255)
+        goto out;
+
+    row = malloc(v[0] * 3);
+    if (row == NULL)
+        goto out;
+    w->w = w->x + v[0] > (int)h->width ? (int)h->width - w->x : v[0];
+    w->h = w->y + v[1] > (int)h->height ? (int)h->height - w->y : v[1];
+    for (y=0; y<w->h; y++) {
+        if (fread(row, 3, v[0], f) != (size_t)v[0])
+            break;
+        for (x=0; x<w->w; x++)
+            memcpy(ui->screen + ((w->y + y) * h->width + w->x + x) * 3, row + x * 3, 3);
+    }
+    free(row);
+    ui_damage(ui, w->x, w->y, w->x + w->w - 1, w->y + w->h - 1);
+    ok = y == w->h;
+out:
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+/*
+ Makes a file name from the config file relative to the directory it is in.
+ */
+static void ui_path(char *out, int size, const char *config, const char *name)
+{
+    const char *slash = strrchr(config, '/');
+
+    if (name[0] == '/' || slash == NULL)
+        snprintf(out, size, "%s", name);
+    else
+        snprintf(out, size, "%.*s/%s", (int)(slash - config), config, name);
+}
+
+static st2205_font *ui_font(st2205_ui *ui, const char *path)
+{
+    struct ui_font *f;
+
+    for (f = ui->fonts; f != NULL; f = f->next) {
+        if (!strcmp(f->path, path))
+            return f->font;
+    }
+
+    f = malloc(sizeof(*f) + strlen(path) + 1);
+    if (f == NULL)
+        return NULL;
+    f->font = st2205_font_load(path);
+    if (f->font == NULL) {
+        free(f);
+        return NULL;
+    }
+    strcpy(f->path, path);
+    f->next = ui->fonts;
+    ui->fonts = f;
+    return f->font;
+}
+
+static int ui_parse(st2205_ui *ui, struct ui_widget *w, const char *config, char *line)
+{
+    st2205_handle *h = ui->h;
+    char kind[16], a[256], b[16], path[PATH_MAX];
+    unsigned int fg, bg;
+    int cols, scale, n;
+
+    a[0] = 0;
+    b[0] = 0;
+    if (sscanf(line, "%15s", kind) != 1)
+        return -1;
+
+    if (!strcmp(kind, "text")) {
+        n = sscanf(line, "%*s %31s %d %d %d %d %x %x %255s", w->name, &w->x, &w->y,
+                   &cols, &scale, &fg, &bg, a);
+        if (n < 7)
+            return -1;
+        if (n == 8) {
+            ui_path(path, sizeof(path), config, a);
+            w->font = ui_font(ui, path);
+            if (w->font == NULL)
+                return -1;
+        }
+        w->type = UI_TEXT;
+        w->label = st2205_label_new(h, w->font, scale, w->x, w->y, cols, fg, bg);
+        return w->label != NULL ? 0 : -1;
+    } else if (!strcmp(kind, "bar")) {
+        if (sscanf(line, "%*s %31s %d %d %d %d %lf %x %x", w->name, &w->x, &w->y,
+                   &w->w, &w->h, &w->max, &fg, &bg) != 8)
+            return -1;
+        w->type = UI_BAR;
+    } else if (!strcmp(kind, "graph")) {
+        if (sscanf(line, "%*s %31s %d %d %d %d %lf %lf %x %x %15s", w->name, &w->x, &w->y,
+                   &w->w, &w->h, &w->min, &w->max, &fg, &bg, b) != 10)
+            return -1;
+        w->type = UI_GRAPH;
+        w->sweep = !strcmp(b, "sweep");
+        if (!w->sweep && strcmp(b, "scroll"))
+            return -1;
+    } else if (!strcmp(kind, "image")) {
+        if (sscanf(line, "%*s %31s %d %d %255s", w->name, &w->x, &w->y, a) != 4)
+            return -1;
+        w->type = UI_IMAGE;
+        if (w->x < 0 || w->y < 0 || w->x >= (int)h->width || w->y >= (int)h->height)
+            return -1;
+        ui_path(path, sizeof(path), config, a);
+        return ui_ppm(ui, w, path);
+    } else {
+        return -1;
+    }
+
+    /* Bars and graphs */
+    if (w->x < 0 || w->y < 0 || w->w < 1 || w->h < 1 ||
+        w->x + w->w > (int)h->width || w->y + w->h > (int)h->height)
+        return -1;
+    w->fg = fg;
+    w->bg = bg;
+    ui_fill(ui, w->x, w->y, w->x + w->w - 1, w->y + w->h - 1, bg);
+    return 0;
+}
+
+st2205_ui *st2205_ui_load(st2205_handle *h, const char *path, int *badline)
+{
+    st2205_ui *ui;
+    struct ui_widget *w;
+    char line[512], *p;
+    unsigned int bg = 0;
+    FILE *f;
+    int lineno = 0, y;
+
+    if (badline != NULL)
+        *badline = 0;
+    f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+
+    ui = calloc(1, sizeof(*ui));
+    if (ui == NULL) {
+        fclose(f);
+        return NULL;
+    }
+    ui->h = h;
+    ui->width = h->width;
+    ui->height = h->height;
+    ui->orient = h->orient;
+    ui->screen = calloc(h->width * h->height, 3);
+    ui->first = malloc(sizeof(int) * h->height * 2);
+    if (ui->screen == NULL || ui->first == NULL)
+        goto fail;
+    ui->last = ui->first + h->height;
+    for (y=0; y<(int)h->height; y++) {
+        ui->first[y] = 0;
+        ui->last[y] = h->width - 1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        p = strchr(line, '#');
+        if (p != NULL)
+            *p = 0;
+        for (p = line; *p == ' ' || *p == '\t'; p++);
+        if (*p == 0 || *p == '\n')
+            continue;
+
+        if (sscanf(p, "background %x", &bg) == 1) {
+            ui_fill(ui, 0, 0, h->width - 1, h->height - 1, bg);
+            continue;
+        }
+
+        w = realloc(ui->w, sizeof(*w) * (ui->n + 1));
+        if (w == NULL)
+            goto fail;
+        ui->w = w;
+        w += ui->n;
+        memset(w, 0, sizeof(*w));
+        ui->n++;
+        if (ui_parse(ui, w, path, p) < 0) {
+            if (badline != NULL)
+                *badline = lineno;
+            goto fail;
+        }
+    }
+    fclose(f);
+    f = NULL;
+
+    st2205_ui_update(ui);
+    return ui;
+
+fail:
+    if (f != NULL)
+        fclose(f);
+    st2205_ui_free(ui);
+    return NULL;
+}
+
+static struct ui_widget *ui_find(st2205_ui *ui, const char *name, int type)
+{
+    int i;
+
+    for (i=0; i<ui->n; i++) {
+        if (ui->w[i].type == type && !strcmp(ui->w[i].name, name))
+            return &ui->w[i];
+    }
+    return NULL;
+}
+
+int st2205_ui_text(st2205_ui *ui, const char *name, const char *text)
+{
+    struct ui_widget *w = ui_find(ui, name, UI_TEXT);
+    char *t;
+
+    if (w == NULL)
+        return -1;
+    t = strdup(text);
+    if (t == NULL)
+        return -1;
+    free(w->text);
+    w->text = t;
+    return 0;
+}
+
+/*
+ A bar only changes the columns between its old and new end. A scrolling
+ graph moves its pixels a column left and draws the new one at the right,
+ so it has to be sent whole. A sweeping graph draws at a cursor going
+ right and starting over at the left, with a blank column after it, so
+ only those two columns are sent.
+ */
+int st2205_ui_value(st2205_ui *ui, const char *name, double v)
+{
+    struct ui_widget *w;
+    unsigned char *row;
+    int col, top, fill, y, rowbytes = ui->width * 3;
+
+    if (ui_stale(ui))
+        return -1;
+    w = ui_find(ui, name, UI_BAR);
+    if (w != NULL) {
+        fill = w->max > 0 ? (int)(v / w->max * w->w + 0.5) : 0;
+        fill = fill < 0 ? 0 : fill > w->w ? w->w : fill;
+        if (fill > w->fill)
+            ui_fill(ui, w->x + w->fill, w->y, w->x + fill - 1, w->y + w->h - 1, w->fg);
+        else if (fill < w->fill)
+            ui_fill(ui, w->x + fill, w->y, w->x + w->fill - 1, w->y + w->h - 1, w->bg);
+        w->fill = fill;
+        return 0;
+    }
+
+    w = ui_find(ui, name, UI_GRAPH);
+    if (w == NULL)
+        return -1;
+
+    top = w->max > w->min ? (int)((v - w->min) / (w->max - w->min) * w->h + 0.5) : 0;
+    top = w->h - (top < 0 ? 0 : top > w->h ? w->h : top);
+
+    if (w->sweep) {
+        col = w->x + w->cursor;
+        w->cursor = (w->cursor + 1) % w->w;
+        if (w->w > 1)
+            ui_fill(ui, w->x + w->cursor, w->y, w->x + w->cursor, w->y + w->h - 1, w->bg);
+    } else {
+        col = w->x + w->w - 1;
+        for (y=0; y<w->h; y++) {
+            row = ui->screen + (w->y + y) * rowbytes + w->x * 3;
+            memmove(row, row + 3, (w->w - 1) * 3);
+        }
+        ui_damage(ui, w->x, w->y, col, w->y + w->h - 1);
+    }
+    if (top > 0)
+        ui_fill(ui, col, w->y, col, w->y + top - 1, w->bg);
+    if (top < w->h)
+        ui_fill(ui, col, w->y + top, col, w->y + w->h - 1, w->fg);
+    return 0;
+}
+
+void st2205_ui_update(st2205_ui *ui)
+{
+    st2205_handle *h = ui->h;
+    st2205_rect rects[ST2205_MAX_RECTS];
+    int i, n, y, full = 1;
+
+    if (ui_stale(ui))
+        return;
+    for (y=0; y<(int)h->height; y++) {
+        if (ui->first[y] != 0 || ui->last[y] != (int)h->width - 1)
+            full = 0;
+    }
+
+    /* Everything goes at first, which also starts the previous frame */
+    if (full) {
+        st2205_send_data(h, ui->screen);
+        for (i=0; i<ui->n; i++) {
+            if (ui->w[i].label != NULL)
+                st2205_label_redraw(ui->w[i].label);
+        }
+    } else {
+        n = plan_rects(h, ui->first, ui->last, rects, ST2205_MAX_RECTS);
+        if (n > 0)
+            st2205_send_rects(h, ui->screen, rects, n);
+    }
+    for (y=0; y<(int)h->height; y++) {
+        ui->first[y] = -1;
+        ui->last[y] = -1;
+    }
+
+    for (i=0; i<ui->n; i++) {
+        if (ui->w[i].label != NULL && (ui->w[i].text != NULL || full)) {
+            st2205_label_set(ui->w[i].label, ui->w[i].text != NULL ? ui->w[i].text : "");
+            free(ui->w[i].text);
+            ui->w[i].text = NULL;
+        }
+    }
+}
+
+void st2205_ui_free(st2205_ui *ui)
+{
+    struct ui_font *f;
+    int i;
+
+    if (ui == NULL)
+        return;
+    for (i=0; i<ui->n; i++) {
+        st2205_label_free(ui->w[i].label);
+        free(ui->w[i].text);
+    }
+    /* After the labels, so the glyphs made for them can go too */
+    while ((f = ui->fonts) != NULL) {
+        ui->fonts = f->next;
+        st2205_font_free(f->font);
+        free(f);
+    }
+    glyphs_sweep(ui->h, 0);
+    free(ui->w);
+    free(ui->screen);
+    free(ui->first);
+    free(ui);
+}
+
+/*
+ Send command to turn bl on or off
+ */
+void st2205_backlight(st2205_handle *h, int on)
+{
+    if (on) {
+        h->buff[0]=CMD_BLON;
+    } else {
+        h->buff[0]=CMD_BLOFF;
+    }
+
+    write_stream(h, h->buff, 1);
+}
+
+int st2205_set_sg_io(st2205_handle *h, int on)
+{
+#ifdef __linux__
+    struct stat st;
+    int sgmax;
+
+    if (!on) {
+        /* /dev/sgN has no other way */
+        if (fstat(h->fd, &st) < 0 || S_ISCHR(st.st_mode))
+            return -1;
+        h->sgmax = 0;
+        return 0;
+    }
+
+    /* Check that it works by reading the ID again */
+    sgmax = sg_max(h->fd);
+    if (!is_photoframe(h->fd, sgmax, h->buff))
+        return -1;
+    h->sgmax = sgmax;
+    return 0;
+#else
+    return on ? -1 : 0;
+#endif
+}
+
+int st2205_set_orientation(st2205_handle *h, int degrees)
+{
+    /* Entry mode I/D and AM bits, for starting in the right corner */
+    static const char entry[4] = { 0x38, 0x20, 0x08, 0x10 };
+    int o = degrees / 90;
+
+    if (degrees % 90 != 0 || o < 0 || o > 3 ||
+        h->proto != PROTO_MERCURY || h->fwver < 3)
+        return -1;
+    if (o == h->orient)
+        return 0;
+
+    /* These were made for the old size and orientation */
+    if (h->fb != NULL || h->comp != NULL || h->glyphs != NULL || h->state != NULL ||
+        h->async != NULL || h->mt != NULL || h->prog != NULL ||
+        (h->queue != NULL && h->queue->head != NULL))
+        return -1;
+
+    if ((o ^ h->orient) & 1) {
+        unsigned int t = h->width;
+        h->width = h->height;
+        h->height = t;
+    }
+    h->orient = o;
+    st2205_invalidate(h);
+
+    h->buff[0] = CMD_SETDIR;
+    h->buff[1] = entry[o];
+    write_stream(h, h->buff, 2);
+    return 0;
 }
 
 void st2205_lcd_sleep(st2205_handle *h, int sleep)
 {
     if (sleep) {
+        /* The LCD forgets its image */
+        st2205_invalidate(h);
         h->buff[0]=CMD_LCDSLEEP;
     } else {
         h->buff[0]=CMD_LCDWAKE;
@@ -580,27 +5352,60 @@ void st2205_lcd_sleep(st2205_handle *h, int sleep)
 
 void st2205_close(st2205_handle *h)
 {
+    st2205_async_stop(h);
+    st2205_mt_stop(h);
+    comp_free(h);
+    glyphs_sweep(h, 1);
+#ifdef __linux__
+    if (h->stream != NULL)
+        stream_stop(h);
+    else
+#endif
+        free_aligned(h->buff, BUFF_SIZE);
     close(h->fd);
-    free_aligned(h->buff, BUFF_SIZE);
 
-    if (h->oldpix != NULL)
-        free(h->oldpix);
+    state_close(h);
+    shadow_free(h);
 
     if (h->rgbabuf != NULL)
         free(h->rgbabuf);
 
+    free(h->tilehash);
+    free(h->yuvpix);
+
+    if (h->prog != NULL) {
+        free(h->prog->pix);
+        free(h->prog->rows);
+        free(h->prog);
+    }
+
+    if (h->queue != NULL) {
+        while (h->queue->head != NULL) {
+            struct st2205_region *r = h->queue->head;
+
+            h->queue->head = r->next;
+            free_region(r);
+        }
+        free(h->queue);
+    }
+
+    if (h->fb != NULL) {
+#ifndef _WIN32
+        fb_unregister(h);
+#endif
+        free_aligned(h->fb, h->fbsize);
+        free(h->fbdirty);
+    }
+
+    free(h->link);
+
     free(h);
 }
 
-static int hack_frame(int f, char *buff)
+static int hack_frame(int f, int sgmax, char *buff)
 {
     ssize_t wrote_bytes;
 
-    if (lseek(f,POS_CMD,SEEK_SET) != POS_CMD) {
-        printf("ERROR: Seek to POS_CMD failed.\n");
-        return 0;
-    }
-
     buff[0]=8;
     buff[1]='H';
     buff[2]='A';
@@ -608,7 +5413,7 @@ static int hack_frame(int f, char *buff)
     buff[4]='K';
     memset(&buff[5], 0, 4);
 
-    wrote_bytes = write(f,buff,0x200);
+    wrote_bytes = dev_write(f, sgmax, POS_CMD, buff, 0x200);
 
     if (wrote_bytes != 0x200) {
         printf("ERROR: Write failed for command hack.\n");
@@ -622,39 +5427,59 @@ st2205_handle *st2205_open(const char *dev)
 {
     st2205_handle *r = NULL;
 #ifndef NO_PARM_BLOCK
-    fw_descriptor *b = NULL;
+    parm_block b;
+#endif
+    int fd, flags, sgmax = 0;
+#ifdef __linux__
+    struct stat st;
 #endif
-    int fd;
     void *buff = NULL;
 
-    fd = open(dev, O_RDWR
+    flags = O_RDWR
 #ifdef _WIN32
-                   | O_BINARY
+            | O_BINARY
 #else
-                   | O_DIRECT
+            | O_DIRECT
+#endif
+            ;
+#ifdef __linux__
+    /* SG_IO doesn't need O_DIRECT, and character devices refuse it */
+    if (stat(dev, &st) == 0 && S_ISCHR(st.st_mode))
+        flags &= ~O_DIRECT;
 #endif
-              );
 
+    fd = open(dev, flags);
     if (fd < 0) {
         perror(dev);
         return NULL;
     }
 
-    if (!is_photoframe(fd)) {
+#ifdef __linux__
+    /* A /dev/sgN can only be used with SG_IO */
+    if (fstat(fd, &st) == 0 && S_ISCHR(st.st_mode))
+        sgmax = sg_max(fd);
+#endif
+
+    select_kernels();
+
+    /*
+     The buffer for sending data is also used for everything read and
+     written while finding out what the device is.
+     */
+    buff = malloc_aligned(BUFF_SIZE);
+    if (buff == NULL) {
         close(fd);
         return NULL;
     }
 
-    buff = malloc_aligned(BUFF_SIZE);
-    if (buff == NULL) {
+    if (!is_photoframe(fd, sgmax, buff)) {
         close(fd);
         free_aligned(buff, BUFF_SIZE);
         return NULL;
     }
 
 #ifndef NO_PARM_BLOCK
-    b = get_parm_block(fd, buff);
-    if (b==NULL) {
+    if (get_parms(fd, sgmax, buff, &b) < 0) {
         printf("Unable to get parm_block\n");
         close(fd);
         free_aligned(buff,BUFF_SIZE);
@@ -663,26 +5488,24 @@ st2205_handle *st2205_open(const char *dev)
 #endif
 
     r = malloc(sizeof(st2205_handle));
-#ifndef NO_PARM_BLOCK
-    if (b->version != 1 || r == NULL) {
-        if (b->version != 1)
-            fprintf(stderr, "Unknown version %hhi\n", b->version);
+    if (r == NULL) {
         close(fd);
         free_aligned(buff, BUFF_SIZE);
         return NULL;
     }
-#endif
 
     r->fd     = fd;
+    r->sgmax  = sgmax;
     r->buff   = buff;
 #ifndef NO_PARM_BLOCK
-    r->width  = b->width;
-    r->height = b->height;
-    r->bpp    = b->bpp;
-    r->proto  = b->proto;
+    r->width  = b.width;
+    r->height = b.height;
+    r->bpp    = b.bpp;
+    r->proto  = b.proto;
     r->oldpix = NULL;
-    r->offx   = b->offx;
-    r->offy   = b->offy;
+    r->offx   = b.offx;
+    r->offy   = b.offy;
+    r->fwver  = b.version;
 #else
     r->width  = 320;
     r->height = 240;
@@ -691,10 +5514,53 @@ st2205_handle *st2205_open(const char *dev)
     r->oldpix = NULL;
     r->offx   = 0;
     r->offy   = 0;
+    r->fwver  = 2;
 #endif
+    r->orient = 0;
     r->rgbabuf = NULL;
+    r->damage_mode = ST2205_DAMAGE_EXACT;
+    r->tilehash = NULL;
+    r->framehash = 0;
+    r->yuvpix = NULL;
+    r->yuvkey = 0;
+    r->lossy = 0;
+    r->lossy_budget = 0;
+    r->progressive = 0;
+    r->progpass = 0;
+    r->prog = NULL;
+    r->queue = NULL;
+    r->async = NULL;
+    r->stream = NULL;
+    r->mt = NULL;
+    r->comp = NULL;
+    r->glyphs = NULL;
+    r->fb = NULL;
+    r->fbdirty = NULL;
+    r->fbsize = 0;
+    r->fbtouched = 0;
+    r->state = NULL;
+    r->statefd = -1;
+    r->link = calloc(1, sizeof(struct st2205_link));
+    if (r->link != NULL) {
+        r->link->write_ns = LINK_WRITE_NS;
+        r->link->byte_ps = LINK_BYTE_PS;
+    }
+
+    if (bind_encoder(r) < 0) {
+        close(fd);
+        free_aligned(buff, BUFF_SIZE);
+        free(r);
+        return NULL;
+    }
 
-    hack_frame(fd, buff);
+    hack_frame(fd, sgmax, buff);
+
+    /* A previous user may have left the LCD rotated */
+    if (r->proto == PROTO_MERCURY && r->fwver >= 3) {
+        r->buff[0] = CMD_SETDIR;
+        r->buff[1] = 0x38;
+        write_stream(r, r->buff, 2);
+    }
 
     DPRINT("libst2205: detected device, %ix%i, %i bpp.\n", r->width, r->height, r->bpp);
 
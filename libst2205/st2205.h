@@ -1,8 +1,21 @@
 #ifndef _ST2205_H_
 #define _ST2205_H_
 
+#include <stdint.h>
+
+struct st2205_encoder;
+struct st2205_progress;
+struct st2205_queue;
+struct st2205_async;
+struct st2205_stream;
+struct st2205_mt;
+struct st2205_comp;
+struct st2205_state;
+struct st2205_link;
+struct st2205_glyphs;
+
 //Handle definition for the st2205_* routines
-typedef struct {
+typedef struct st2205_handle {
        int fd;
        unsigned int width;
        unsigned int height;
@@ -13,8 +26,50 @@ typedef struct {
        int offx;
        int offy;
        unsigned char* rgbabuf;
+       const struct st2205_encoder *enc;
+       int damage_mode;
+       uint64_t *tilehash;
+       uint64_t framehash;
+       unsigned char* yuvpix;
+       int yuvkey;
+       int lossy;
+       int lossy_budget;
+       int progressive;
+       int progpass;
+       struct st2205_progress *prog;
+       struct st2205_queue *queue;
+       struct st2205_async *async;
+       struct st2205_stream *stream;
+       struct st2205_mt *mt;
+       struct st2205_comp *comp;
+       unsigned char* fb;
+       unsigned char* fbdirty;
+       long fbsize;
+       volatile int fbtouched;
+       struct st2205_state *state;
+       int statefd;
+       struct st2205_link *link;
+       struct st2205_glyphs *glyphs;
+       int orient;
+       int fwver;
+       int sgmax;
 } st2205_handle;
 
+/*
+ A rectangle (xs,ys)-(xe,ye), inclusive.
+ */
+typedef struct {
+       int xs;
+       int ys;
+       int xe;
+       int ye;
+} st2205_rect;
+
+/*
+ Most windows st2205_send_data() splits a frame update into.
+ */
+#define ST2205_MAX_RECTS 16
+
 /*
  Opens the device pointed to by dev (which is /dev/sdX) and reads its
  capabilities. Returns handle.
@@ -32,11 +87,36 @@ void st2205_close(st2205_handle *h);
  */
 void st2205_send_data(st2205_handle *h, unsigned char *pixinfo);
 
+/*
+ Find what changed in an array of h->width*h->height r,g,b triplets since
+ the last st2205_send_data(). Stores at most max disjoint rectangles covering
+ the changes, chosen to minimize bytes sent, and returns how many.
+ */
+int st2205_find_damage(st2205_handle *h, unsigned char *pixinfo, st2205_rect *rects, int max);
+
 /*
  Send part of an array of h->width*h->height r,g,b triplets.
  */
 void st2205_send_partial(st2205_handle *h, unsigned char *pixinfo, int xs, int ys, int xe, int ye);
 
+/*
+ Pre-encoded blobs, for images sent over and over. st2205_encode() turns
+ part of an array of h->width*h->height r,g,b triplets into a blob,
+ ready to be written to the device, and st2205_send_blob() sends it with
+ no work per pixel. It returns -1 if the blob was made for a display set
+ up differently. A blob is st2205_blob_size() bytes, which can be saved
+ to a file, by st2205_save_blob() or otherwise. st2205_load_blob() maps
+ such a file, so it isn't even copied, and returns NULL if it isn't a
+ whole blob. Blobs are only meant for machines like the one that made
+ them. Free them with st2205_free_blob().
+ */
+void *st2205_encode(st2205_handle *h, unsigned char *pixinfo, int xs, int ys, int xe, int ye);
+long st2205_blob_size(const void *blob);
+int st2205_send_blob(st2205_handle *h, const void *blob);
+int st2205_save_blob(const void *blob, const char *path);
+void *st2205_load_blob(const char *path);
+void st2205_free_blob(void *blob);
+
 
 /*
  Same as above, but RGBA arrangement, ignoring A.
@@ -45,6 +125,284 @@ void st2205_rgba(st2205_handle *h, const unsigned char *data);
 void st2205_rgba_partial(st2205_handle *h, const unsigned char *data,
                          int xs, int ys, int xe, int ye);
 
+/*
+ Send n rects of an array of h->width*h->height r,g,b triplets, all in
+ one USB transfer, without looking for changes. Use this when you already
+ know what changed. Later st2205_send_data() calls will know about it.
+ */
+void st2205_send_rects(st2205_handle *h, unsigned char *pixinfo, const st2205_rect *rects, int n);
+
+/*
+ Pixel formats for st2205_blit(). The 32 bit and 16 bit ones are
+ words in host byte order.
+ */
+#define ST2205_FMT_RGB24    0 /* r,g,b bytes */
+#define ST2205_FMT_BGR24    1 /* b,g,r bytes */
+#define ST2205_FMT_RGBA     2 /* r,g,b,a bytes, ignoring a */
+#define ST2205_FMT_BGRA     3 /* b,g,r,a bytes, ignoring a, like st2205_rgba() */
+#define ST2205_FMT_XRGB8888 4 /* 0xXXRRGGBB words, like cairo and pixman use */
+#define ST2205_FMT_RGB565   5 /* 5-6-5 words */
+#define ST2205_FMT_GD       6 /* gd truecolor ints, ignoring alpha */
+
+/*
+ Send a width x height image at (dstx,dsty), from rows stride bytes apart
+ in the given format. The image doesn't need to be in a full frame buffer.
+ Returns 0, or -1 for an unknown format or when out of memory.
+ */
+int st2205_blit(st2205_handle *h, const void *src, int stride, int format,
+                int dstx, int dsty, int width, int height);
+
+/*
+ Send a frame of planar YUV, as video decoders output. I420 has separate
+ U and V planes, NV12 has them interleaved. Chroma is subsampled 2x2, and
+ Y, U and V are in limited range, converted using the given standard.
+ Changes are found by comparing YUV with the last frame, so only changed
+ parts are converted and sent.
+ */
+#define ST2205_YUV_BT601 0
+#define ST2205_YUV_BT709 1
+void st2205_i420(st2205_handle *h, const unsigned char *y, int ystride,
+                 const unsigned char *u, const unsigned char *v, int uvstride,
+                 int colorspace);
+void st2205_nv12(st2205_handle *h, const unsigned char *y, int ystride,
+                 const unsigned char *uv, int uvstride, int colorspace);
+
+/*
+ Get a framebuffer of h->width*h->height r,g,b triplets, owned by the
+ library and freed by st2205_close(). Writes to it are tracked a page at
+ a time, so st2205_fb_flush() only looks at rows on pages which were
+ written, and returns right away if none were. This uses a SIGSEGV
+ handler, which passes on faults outside the framebuffer to the handler
+ that was there before. Returns NULL when out of memory.
+ */
+unsigned char *st2205_fb_alloc(st2205_handle *h);
+void st2205_fb_flush(st2205_handle *h);
+
+/*
+ How changes are found. ST2205_DAMAGE_EXACT keeps a copy of the last frame
+ in oldpix and compares pixels. ST2205_DAMAGE_TILES only keeps a hash of
+ every 16x16 tile, using much less memory, and resends whole tiles. An
+ unchanged frame is detected from a hash of the whole frame. Changing the
+ mode causes the next frame to be sent in full. Other modes are ignored.
+ */
+#define ST2205_DAMAGE_EXACT 0
+#define ST2205_DAMAGE_TILES 1
+void st2205_set_damage_mode(st2205_handle *h, int mode);
+
+/*
+ Lossy mode for noisy sources like cameras. A pixel only counts as changed
+ when a color component is more than threshold away from what is on the
+ display, which is what later frames are compared with, so errors don't
+ build up. With a budget in bytes, the threshold is raised for frames
+ whose changes would cost more than that to send. Zero for both is exact.
+ This only applies to ST2205_DAMAGE_EXACT. For st2205_i420() and
+ st2205_nv12(), the threshold applies to Y, U and V.
+ */
+void st2205_set_lossy(st2205_handle *h, int threshold, int budget);
+
+/*
+ Progressive mode. When the changes st2205_send_data() or st2205_rgba()
+ find would cost more than the given number of bytes to send, only every
+ 4th row of them is sent right away. Each st2205_refine() call sends
+ more rows, and returns how many calls are still needed, or 0 when the
+ frame is complete. Sending anything else cancels the rest. 0 turns
+ progressive mode off.
+ */
+void st2205_set_progressive(st2205_handle *h, int bytes);
+int st2205_refine(st2205_handle *h);
+
+/*
+ Queue part of an array of h->width*h->height r,g,b triplets to be sent
+ by st2205_step(). The pixels are copied, so the array can change right
+ after. Regions with a higher priority go first, then ones with the
+ earliest deadline, in ms from now, where 0 is none. Returns 0, or -1
+ when out of memory.
+ */
+int st2205_queue_rect(st2205_handle *h, const unsigned char *pixinfo, int xs, int ys, int xe, int ye,
+                      int priority, int deadline_ms);
+
+/*
+ Send one chunk of at most max_bytes from the first queued region. If
+ max_bytes is 0, the chunk is what sending is expected to take about
+ ST2205_CHUNK_US microseconds for, going by st2205_estimate_cost(). A
+ chunk is always at least one row. Returns how many regions are still
+ queued. Regions queued between calls get sent ahead of the rest of a big
+ one if they come first.
+ */
+#define ST2205_CHUNK_US 16000
+int st2205_step(st2205_handle *h, int max_bytes);
+
+/*
+ Start an I/O thread which sends frames given to st2205_submit(), so
+ the caller doesn't wait for USB. Returns an eventfd, which counts the
+ frames sent, for use with poll() or an event loop, or -1 on failure.
+ Until st2205_async_stop(), no other calls may be made on h. What the
+ caller does next overlaps sending, but the thread finds changes in and
+ encodes a frame only after the last one was written. With streaming
+ mode on, encoding a frame also overlaps writing the start of it.
+ */
+int st2205_async_start(st2205_handle *h);
+
+/*
+ Copy an array of h->width*h->height r,g,b triplets to be sent by the
+ I/O thread, and return right away. A frame which wasn't picked up yet is
+ replaced, so only the newest frame gets sent. Without the thread, this
+ is st2205_send_data().
+ */
+void st2205_submit(st2205_handle *h, const unsigned char *pixinfo);
+
+/*
+ Send the last frame submitted, if it wasn't yet, and stop the I/O thread.
+ st2205_close() does this too.
+ */
+void st2205_async_stop(st2205_handle *h);
+
+/*
+ Streaming mode. Instead of encoding everything into one big buffer and
+ then writing it, a small ring of chunks is used, and each is written by
+ a separate thread as soon as it is full, while the next is encoded. This
+ starts USB transfers sooner and uses 64 KB instead of 460 KB per handle:
+ four chunks of up to 16 KB, filled to a size picked from how fast
+ writes have been.
+ Returns 0, or -1 on failure or without Linux.
+ */
+int st2205_set_streaming(st2205_handle *h, int on);
+
+/*
+ Thread-safe drawing. st2205_mt_start() starts a flusher thread and
+ returns a framebuffer of h->width*h->height r,g,b triplets, or NULL on
+ failure. Any number of threads may draw into it, and then call
+ st2205_post_damage() for what they changed. That never waits for USB,
+ or for other threads. The flusher merges all damage posted while it was
+ busy and sends it. Until st2205_mt_stop(), which sends what was posted
+ and frees the framebuffer, no other calls may be made on h.
+ */
+unsigned char *st2205_mt_start(st2205_handle *h);
+void st2205_post_damage(st2205_handle *h, int xs, int ys, int xe, int ye);
+void st2205_mt_stop(st2205_handle *h);
+
+/*
+ Compositor. A layer is a width x height array of r,g,b,a pixels, shown
+ at (x,y) over the layers with a lower z, and over black. The layer's
+ alpha scales the alpha of its pixels. After drawing into a layer, call
+ st2205_layer_damage() with what changed, in layer coordinates. Moving,
+ restacking, fading, hiding and freeing layers note their own damage.
+ st2205_compose() then recomposes and sends only what was damaged. All
+ layers are freed by st2205_close().
+ */
+typedef struct st2205_layer st2205_layer;
+st2205_layer *st2205_layer_new(st2205_handle *h, int width, int height, int x, int y, int z);
+unsigned char *st2205_layer_pixels(st2205_layer *l);
+void st2205_layer_damage(st2205_layer *l, int xs, int ys, int xe, int ye);
+void st2205_layer_move(st2205_layer *l, int x, int y);
+void st2205_layer_set_z(st2205_layer *l, int z);
+void st2205_layer_set_alpha(st2205_layer *l, int alpha);
+void st2205_layer_show(st2205_layer *l, int visible);
+void st2205_layer_free(st2205_layer *l);
+void st2205_compose(st2205_handle *h);
+
+/*
+ Keep the record of what is on the display in the file at path, so that
+ after a restart, updates can carry on from there instead of starting
+ with a full repaint. This is the previous frame kept in exact damage
+ mode; tile hashes aren't kept. Call this right after st2205_open().
+ What the file holds is only used if it was left by st2205_close() on the
+ same display, while plugged in the same way and since the last boot.
+ Returns 1 if it was used, 0 if not, and -1 if the file can't be used,
+ for example because another process has it.
+ */
+int st2205_set_state_file(st2205_handle *h, const char *path);
+
+/*
+ Predicted microseconds to send the n rects in one go. Every write to the
+ device is timed, and from that, the time one takes is worked out as a
+ fixed cost plus a cost per byte, which differ between hosts and hubs.
+ Before anything was sent, this is a rough guess.
+ */
+long st2205_estimate_cost(st2205_handle *h, const st2205_rect *rects, int n);
+
+/*
+ Text. A label is a row of cols character cells at (x,y), drawn with a
+ font at scale times its size, in colors 0xRRGGBB. A NULL font is the
+ built in 8x8 one, or st2205_font_load() loads a PSF font. Glyphs are
+ drawn and encoded the first time they are needed and then kept until
+ st2205_close(), so showing them again costs no work per pixel.
+ st2205_label_set() only sends the cells which changed, padding text
+ with spaces, and returns how many it sent, or -1. st2205_label_new()
+ returns NULL if the label doesn't fit on the display. At 12 bpp, x is
+ rounded down to even. After anything else draws over a label,
+ st2205_label_redraw() makes the next st2205_label_set() send it all.
+ Glyphs hold a reference to their font, so st2205_font_free() may be
+ called while labels still use it. Then the font and its glyphs go with
+ the last of those labels. Free labels with st2205_label_free() before
+ st2205_close(), which frees the glyphs they use.
+ */
+typedef struct st2205_font st2205_font;
+typedef struct st2205_label st2205_label;
+st2205_font *st2205_font_load(const char *path);
+void st2205_font_free(st2205_font *f);
+st2205_label *st2205_label_new(st2205_handle *h, const st2205_font *font, int scale,
+                               int x, int y, int cols, uint32_t fg, uint32_t bg);
+int st2205_label_set(st2205_label *l, const char *text);
+void st2205_label_redraw(st2205_label *l);
+void st2205_label_free(st2205_label *l);
+
+/*
+ Widgets read from a file and drawn by st2205_ui_load(). The file has
+ one widget per line:
+
+   background RRGGBB
+   text  NAME X Y COLS SCALE FG BG [FONT.psf]
+   bar   NAME X Y W H MAX FG BG
+   graph NAME X Y W H MIN MAX FG BG scroll|sweep
+   image NAME X Y FILE.ppm
+
+ Colors are hexadecimal RRGGBB. A text widget is a label, with the built
+ in font if none is given. A graph either scrolls left as values are
+ added, or sweeps across, overwriting the oldest. Images are binary PPM.
+ Anything after a # is a comment, and relative file names are relative to
+ the file. Widgets shouldn't overlap.
+
+ st2205_ui_load() returns NULL on failure, and if badline isn't NULL,
+ stores the number of the line which was wrong there, or 0 if it was
+ something else, such as a file that can't be read. st2205_ui_text() sets
+ the text of a text widget, and st2205_ui_value() the value of a bar or
+ adds one to a graph. Changes go out with the next st2205_ui_update(),
+ which only sends what the widgets changed. Free with st2205_ui_free()
+ before st2205_close().
+ */
+typedef struct st2205_ui st2205_ui;
+st2205_ui *st2205_ui_load(st2205_handle *h, const char *path, int *badline);
+int st2205_ui_text(st2205_ui *ui, const char *name, const char *text);
+int st2205_ui_value(st2205_ui *ui, const char *name, double v);
+void st2205_ui_update(st2205_ui *ui);
+void st2205_ui_free(st2205_ui *ui);
+
+/*
+ Send everything as SCSI commands through the SG_IO ioctl instead of
+ writing to the block device, or go back to the block device. Linux only.
+ A /dev/sgN given to st2205_open() always uses SG_IO. Returns 0, or -1 if
+ that's not possible.
+ */
+int st2205_set_sg_io(st2205_handle *h, int on);
+
+/*
+ For a frame turned 0, 90, 180 or 270 degrees clockwise, so frames are
+ given the way it is standing. Width and height are swapped for 90 and
+ 270. Call it right after st2205_open(). It needs the Mercury firmware
+ hack with CMD_SETDIR, and fails if there is a state file, framebuffer,
+ compositor, I/O or flusher thread, progressive frame, queued region,
+ or glyphs kept for labels. Labels and widgets made before rotating stop
+ working. Returns 0, or -1 if rotation is not possible.
+ */
+int st2205_set_orientation(st2205_handle *h, int degrees);
+
+/*
+ Forget what is on the display, so the next st2205_send_data() or
+ st2205_rgba() sends the full screen.
+ */
+void st2205_invalidate(st2205_handle *h);
+
 /*
 Turn the backlight on or off
 */
@@ -31,6 +31,11 @@
 #ifndef _WIN32
 #include <sys/mman.h>
 #endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <scsi/sg.h>
+#endif
 #include <time.h>
 
 #define USB_PACKET_SIZE 64
@@ -50,6 +55,9 @@
 
 unsigned char *buff; /* Main buffer used for data */
 unsigned char *cmdbuf; /* Small buffer used for commands */
+int sgio; /* Use SG_IO instead of reading and writing the device */
+int sgmax; /* Most bytes in one SG_IO command */
+int timing; /* Print how long every read and write took */
 
 /*
 Two routines to allocate/deallocate page-aligned memory, for use with the
@@ -87,6 +95,131 @@ static void free_aligned(void *addr, long size) {
 }
 
 
+/*
+Reads and writes of the device. With sgio, these are SCSI READ(10) and
+WRITE(10) commands sent with the SG_IO ioctl, at LBA offset/512, so the
+block layer doesn't split them. That works with /dev/sgN too. Longer
+transfers are sent as several commands of at most sgmax bytes, the most
+the device takes. This is done the same way in libst2205.
+*/
+
+#define SG_TIMEOUT 10000 /* ms */
+#define SG_DEFAULT_MAX 0x10000
+
+#ifdef __linux__
+static int sg_cmd(int f, int wr, unsigned int offset, unsigned char *buff, int len) {
+    unsigned char cdb[10], sense[32];
+    unsigned int lba = offset / SCSI_SECTOR_SIZE;
+    int sectors = len / SCSI_SECTOR_SIZE;
+    sg_io_hdr_t io;
+
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = wr ? 0x2a : 0x28;
+    cdb[2] = lba>>24;
+    cdb[3] = lba>>16;
+    cdb[4] = lba>>8;
+    cdb[5] = lba;
+    cdb[7] = sectors>>8;
+    cdb[8] = sectors;
+
+    memset(&io, 0, sizeof(io));
+    io.interface_id = 'S';
+    io.dxfer_direction = wr ? SG_DXFER_TO_DEV : SG_DXFER_FROM_DEV;
+    io.cmd_len = sizeof(cdb);
+    io.cmdp = cdb;
+    io.mx_sb_len = sizeof(sense);
+    io.sbp = sense;
+    io.dxfer_len = len;
+    io.dxferp = buff;
+    io.timeout = SG_TIMEOUT;
+
+    if (ioctl(f, SG_IO, &io) < 0) {
+        perror("SG_IO");
+        return -1;
+    }
+    if ((io.info & SG_INFO_OK_MASK) != SG_INFO_OK) {
+        printf("ERROR: SCSI status 0x%02x, host 0x%x, driver 0x%x.\n",
+               io.status, io.host_status, io.driver_status);
+        return -1;
+    }
+    return len - io.resid;
+}
+
+static int sg_rw(int f, int wr, unsigned int offset, unsigned char *buff, int len) {
+    int done, n, r;
+
+    for (done = 0; done < len; done += n) {
+        n = len - done < sgmax ? len - done : sgmax;
+        r = sg_cmd(f, wr, offset + done, buff + done, n);
+        if (r < 0) {
+            return done ? done : -1;
+        }
+        if (r < n) {
+            return done + r;
+        }
+    }
+    return len;
+}
+
+/*
+The largest transfer the device takes, in whole sectors. The sg driver
+gives it in bytes, block devices in sectors.
+*/
+static int sg_max(int f) {
+    struct stat st;
+    unsigned short sectors = 0;
+    int bytes = 0;
+
+    if (fstat(f, &st) < 0) return SG_DEFAULT_MAX;
+    if (S_ISCHR(st.st_mode)) {
+        if (ioctl(f, BLKSECTGET, &bytes) < 0 || bytes < SCSI_SECTOR_SIZE) return SG_DEFAULT_MAX;
+    } else {
+        if (ioctl(f, BLKSECTGET, &sectors) < 0 || sectors == 0) return SG_DEFAULT_MAX;
+        bytes = sectors * SCSI_SECTOR_SIZE;
+    }
+    /* WRITE(10) has 16 bits for the number of sectors */
+    if (bytes > 0xffff * SCSI_SECTOR_SIZE) bytes = 0xffff * SCSI_SECTOR_SIZE;
+    return bytes & ~(SCSI_SECTOR_SIZE-1);
+}
+#endif
+
+static double now_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+static int dev_rw(int f, int wr, unsigned int offset, unsigned char *buff, int len) {
+    double t = 0;
+    int r;
+
+    if (timing) t = now_ms();
+#ifdef __linux__
+    if (sgio) {
+        r = sg_rw(f, wr, offset, buff, len);
+    } else
+#endif
+    if (lseek(f,offset,SEEK_SET) != offset) {
+        printf("ERROR: Seek to 0x%x failed.\n", offset);
+        r = -1;
+    } else {
+        r = wr ? write(f,buff,len) : read(f,buff,len);
+    }
+    if (timing) {
+        fprintf(stderr, "%s 0x%04x 0x%x bytes: %.3f ms\n",
+                wr ? "write" : "read ", offset, len, now_ms() - t);
+    }
+    return r;
+}
+
+static int dev_read(int f, unsigned int offset, unsigned char *buff, int len) {
+    return dev_rw(f, 0, offset, buff, len);
+}
+
+static int dev_write(int f, unsigned int offset, unsigned char *buff, int len) {
+    return dev_rw(f, 1, offset, buff, len);
+}
+
 /*
 Checks if the device is a photo frame by reading the first 512 bytes and
 comparing against the known string that's there
@@ -96,8 +229,7 @@ static int is_photoframe(int f) {
     char id[]="SITRONIX CORP.";
     char *buff;
     buff=malloc_aligned(0x200);
-    lseek(f,0x0,SEEK_SET);
-    y=read(f,buff,0x200);
+    y=dev_read(f,0x0,(unsigned char *)buff,0x200);
     if (y != 0x200) return 0;
     buff[15]=0;
 //    fprintf(stderr,"ID=%s\n",buff);
@@ -137,11 +269,6 @@ static int sendcmd(int f,int cmd,
                    unsigned int arg1, unsigned int arg2, unsigned char arg3) {
     ssize_t wrote_bytes;
 
-    if (lseek(f,POS_CMD,SEEK_SET) != POS_CMD) {
-        printf("ERROR: Seek to POS_CMD failed.\n");
-        return 0;
-    }
-
     cmdbuf[0]=cmd;
     cmdbuf[1]=(arg1>>24)&0xff;
     cmdbuf[2]=(arg1>>16)&0xff;
@@ -153,7 +280,7 @@ static int sendcmd(int f,int cmd,
     cmdbuf[8]=(arg2>>0)&0xff;
     cmdbuf[9]=(arg3);
     //printf("%02X %02X %02X %02X %02X\n", cmdbuf[0], cmdbuf[1], cmdbuf[2], cmdbuf[3], cmdbuf[4]);
-    wrote_bytes = write(f,cmdbuf,SCSI_SECTOR_SIZE);
+    wrote_bytes = dev_write(f,POS_CMD,cmdbuf,SCSI_SECTOR_SIZE);
 
     if (wrote_bytes != SCSI_SECTOR_SIZE) {
         printf("ERROR: Write failed for command %i.\n", cmd);
@@ -175,19 +302,16 @@ static int tst(int f) {
     buff[5]=0;
     buff[6]=0;
     buff[7]=0;
-    lseek(f,0x4400,SEEK_SET);
-    return write(f,buff,0x200);
+    return dev_write(f,0x4400,buff,0x200);
 }
 #endif
 
 static int read_data(int f, unsigned char *buff, int len) {
-    lseek(f,POS_RDAT,SEEK_SET);
-    return read(f,buff,len);
+    return dev_read(f,POS_RDAT,buff,len);
 }
 
 static int write_data(int f, unsigned char *buff, int len) {
-    lseek(f,POS_WDAT,SEEK_SET);
-    return write(f,buff,len);
+    return dev_write(f,POS_WDAT,buff,len);
 }
 
 static int get_mem_size(int f) {
@@ -596,18 +720,13 @@ static int hack_frame(int f, char *tag, unsigned char *b)
         return 0;
     }
 
-    if (lseek(f,POS_CMD,SEEK_SET) != POS_CMD) {
-        printf("ERROR: Seek to POS_CMD failed.\n");
-        return 0;
-    }
-
     buff[0]=8;
     memcpy(&buff[1], tag, len);
     if (len == 4) memset(&buff[5], 0, 4);
 
     memcpy(&buff[SCSI_SECTOR_SIZE-USB_PACKET_SIZE], b, USB_PACKET_SIZE);
 
-    wrote_bytes = write(f,buff,SCSI_SECTOR_SIZE);
+    wrote_bytes = dev_write(f,POS_CMD,buff,SCSI_SECTOR_SIZE);
 
     if (wrote_bytes != SCSI_SECTOR_SIZE) {
         printf("ERROR: Write failed for command hack.\n");
@@ -897,7 +1016,7 @@ static void print_usage(char *s)
 {
     int i;
 
-    printf("Usage: %s DEVICE COMMAND [PARAMETER]\n",s);
+    printf("Usage: %s [OPTIONS] DEVICE COMMAND [PARAMETER]\n",s);
     for (i = 0; i < sizeof(commands)/sizeof(struct command_s); i++) {
         printf(" %s: %s\n", commands[i].cmdlparam, commands[i].help);
     }
@@ -912,6 +1031,12 @@ static void print_usage(char *s)
 #endif
 "\n"
 "PARAMETER: Filename or other information for particular command.\n"
+"\n"
+"OPTIONS:\n"
+#ifdef __linux__
+" --sg-io: send SCSI commands with SG_IO, always used with /dev/sgN\n"
+#endif
+" --time: print how long every read and write of the device took\n"
 "\n"
     );
 
@@ -921,6 +1046,26 @@ int main(int argc, char** argv) {
     int f,o=-1;
     unsigned int i;
     const struct command_s *command=NULL;
+#ifdef __linux__
+    struct stat st;
+#endif
+    char *prog=argv[0];
+
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+#ifdef __linux__
+        if (strcmp(argv[1], "--sg-io") == 0) {
+            sgio=1;
+        } else
+#endif
+        if (strcmp(argv[1], "--time") == 0) {
+            timing=1;
+        } else {
+            break;
+        }
+        argv++;
+        argc--;
+    }
+    argv[0]=prog;
 
     if (argc<3) {
         print_usage(argv[0]);
@@ -952,13 +1097,29 @@ int main(int argc, char** argv) {
         exit(1);
     }
 
-    f=open(argv[1],O_RDWR
+#ifdef __linux__
+    /* /dev/sgN only works with SG_IO, and refuses O_DIRECT */
+    if (stat(argv[1], &st) == 0 && S_ISCHR(st.st_mode)) {
+        sgio=1;
+    }
+#endif
+
+    if (sgio) {
+        f=open(argv[1],O_RDWR);
+    } else {
+        f=open(argv[1],O_RDWR
 #ifdef _WIN32
-                   |O_BINARY
+                       |O_BINARY
 #else
-                   |O_DIRECT|O_SYNC
+                       |O_DIRECT|O_SYNC
+#endif
+                       );
+    }
+#ifdef __linux__
+    if (sgio && f >= 0) {
+        sgmax=sg_max(f);
+    }
 #endif
-                   );
 
     //check if dev really is a photo-frame
     if (!is_photoframe(f)) {
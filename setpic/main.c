@@ -174,10 +174,7 @@ void testpic(st2205_handle *h, char* what) {
     while (c!='q') {
     //force complete image redraw instead of the optimized
     //draw-only-whats-changed stuff
-    if (h->oldpix!=NULL) {
-        free(h->oldpix);
-        h->oldpix=NULL;
-    }
+    st2205_invalidate(h);
     if (c=='i') {
         printf(" With this mode, you can find some values for a new specfile.\n");
         printf(" u and d moves picture up and down\n");